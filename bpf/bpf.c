@@ -1,5 +1,11 @@
 #include "bpf_api.h"
 
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/udp.h>
+
 /* Minimal, stand-alone toy map pinning example:
  *
  * clang -target bpf -O2 [...] -o bpf_shared.o -c bpf_shared.c
@@ -18,27 +24,1888 @@
  * instance is being created.
  */
 
+/* Building with -DKEYMASH_PERCPU_MAP gives every CPU its own copy of the
+ * impairment config. Userspace then replicates each write across all CPUs in a
+ * single update, and the per-packet lookup never touches a cache line that
+ * another core (or the writer) is dirtying. The pinned map must be removed
+ * when switching between the two layouts.
+ */
+#ifdef KEYMASH_PERCPU_MAP
+# define KEYMASH_MAP_TYPE	BPF_MAP_TYPE_PERCPU_ARRAY
+#else
+# define KEYMASH_MAP_TYPE	BPF_MAP_TYPE_ARRAY
+#endif
+
+/* Building with -DKEYMASH_OFFLOAD gives a reduced classifier for NICs that
+ * run tc programs in hardware (see "setup-tc.sh offload"). Such NICs offer
+ * plain array and hash maps, direct packet access and a handful of helpers,
+ * so this build draws its random numbers from a xorshift state kept in a map
+ * and leaves out everything else: the Gilbert-Elliott model, shaping, delay,
+ * events, map_keymash_fast, cgroup profiles and the stage pipeline.
+ */
+#ifdef KEYMASH_OFFLOAD
+# ifdef KEYMASH_PERCPU_MAP
+#  error "per-CPU maps can not be offloaded"
+# endif
+/* same pin name as the host build's per-CPU map; the pins have to go when
+ * switching builds, see README.md
+ */
+# define KEYMASH_STATS_MAP_TYPE	BPF_MAP_TYPE_ARRAY
+#else
+# define KEYMASH_STATS_MAP_TYPE	BPF_MAP_TYPE_PERCPU_ARRAY
+#endif
+
+/* Building with -DKEYMASH_INSTRUMENT makes the tc and XDP entry points time
+ * every packet, targeted or not, from entry to verdict and count the result
+ * in map_keymash_latency. The clock reads themselves cost a few tens of ns,
+ * so leave this off unless measuring.
+ */
+#if defined(KEYMASH_INSTRUMENT) && defined(KEYMASH_OFFLOAD)
+# error "the offload build has no clock to instrument with"
+#endif
+
+enum keymash_model {
+    /* every packet is dropped independently with drop_threshold */
+    KEYMASH_MODEL_BERNOULLI,
+    /* two-state Gilbert-Elliott chain for bursty loss, see keymash_gilbert_elliott */
+    KEYMASH_MODEL_GILBERT_ELLIOTT,
+};
+
+enum keymash_ctl_mode {
+    /* drop_threshold is applied as configured */
+    KEYMASH_CTL_OFF,
+    /* drop_threshold is the loss the profile's traffic should see in the end, see keymash_ctl_update */
+    KEYMASH_CTL_LOSS,
+    /* the drop threshold is steered so that ctl_target_rate bytes per second get through */
+    KEYMASH_CTL_RATE,
+};
+
+enum keymash_scope {
+    /* the drop threshold and stats are the same for all of the host */
+    KEYMASH_SCOPE_HOST,
+    /* per receive queue (transmit queue on egress), see map_keymash_units */
+    KEYMASH_SCOPE_QUEUE,
+    /* per CPU the filter runs on */
+    KEYMASH_SCOPE_CPU,
+    /* per NUMA node the filter runs on */
+    KEYMASH_SCOPE_NODE,
+};
+
+/* Value of map_keymash. All probabilities are thresholds that a uniform
+ * random u32 is compared against, i.e. p * UINT32_MAX. Userspace publishes
+ * a whole struct at once, see keymash_config_load.
+ */
+struct keymash_config {
+    /* set by userspace when publishing, like generation_end; must match map_keymash_active */
+    uint32_t generation;
+    /* if non-zero, random draws are derived from seed instead, see keymash_random */
+    uint32_t seeded;
+    /* drop probability (of the good state, for Gilbert-Elliott) */
+    uint32_t drop_threshold;
+    uint32_t model;
+    /* Gilbert-Elliott: per-packet good -> bad and bad -> good transition probabilities */
+    uint32_t ge_enter_bad;
+    uint32_t ge_exit_bad;
+    /* Gilbert-Elliott: drop probability in the bad state */
+    uint32_t ge_bad_drop;
+    /* token bucket depth; only used if rate_bytes_per_sec is non-zero */
+    uint32_t burst_bytes;
+    /* token bucket refill rate per targeted flow, 0 to disable shaping */
+    uint64_t rate_bytes_per_sec;
+    /* egress only: hold packets for delay_ns plus a uniform [0, jitter_ns) */
+    uint64_t delay_ns;
+    uint32_t jitter_ns;
+    /* report 1 in event_sample_every targeted packets to map_keymash_events, 0 to disable */
+    uint32_t event_sample_every;
+    /* UDP packets whose RTP sequence number is a multiple of seq_class_every are dropped with
+     * seq_class_threshold instead of the model's threshold; 0 to disable */
+    uint32_t seq_class_every;
+    uint32_t seq_class_threshold;
+    /* UDP only: flip one random bit of the UDP payload with corrupt_threshold, and fix up
+     * the checksum if corrupt_fix_csum is set (else the receiving stack drops the packet) */
+    uint32_t corrupt_threshold;
+    uint32_t corrupt_fix_csum;
+    /* UDP over IPv4 only: cut the UDP payload down to truncate_len bytes with truncate_threshold */
+    uint32_t truncate_threshold;
+    uint32_t truncate_len;
+    /* egress only: hold packets back by a further reorder_ns with reorder_threshold */
+    uint32_t reorder_threshold;
+    uint32_t reorder_ns;
+    uint64_t seed;
+    /* enum keymash_ctl_mode; the controller re-evaluates its threshold every ctl_interval_ns */
+    uint32_t ctl_mode;
+    uint32_t ctl_interval_ns;
+    uint64_t ctl_target_rate;
+    /* enum keymash_scope; selects the entry of map_keymash_units and map_keymash_unit_stats */
+    uint32_t scope;
+    /* a copy of generation, so that a copy of the struct can be checked at both ends */
+    uint32_t generation_end;
+};
+
 struct {
-    // declare that the bpf map will be of type array, mapping uint32_t to uint32_t and have a maximum of one entry.
-    __uint(type, BPF_MAP_TYPE_ARRAY);
+    // declare that the bpf map will be of type array (or per-CPU array), mapping uint32_t to struct keymash_config and have two entries: the live config and the one being written.
+    __uint(type, KEYMASH_MAP_TYPE);
     __uint(key_size, sizeof(uint32_t)); 
-    __uint(value_size, sizeof(uint32_t));
-    __uint(max_entries, 1);
+    __uint(value_size, sizeof(struct keymash_config));
+    __uint(max_entries, 2);
     // PIN_BY_NAME ensures that the map is pinned in /sys/fs/bpf
     __uint(pinning, LIBBPF_PIN_BY_NAME);
     // synchronize the `map_keymash` name with the userspace program
 } map_keymash __section(".maps");
 
-__section("classifier")
-int scream_bpf(struct __sk_buff *skb)
+struct {
+    // generation of the live config; it sits in slot generation % 2 of map_keymash
+    __uint(type, KEYMASH_MAP_TYPE);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, 1);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_active __section(".maps");
+
+#ifndef KEYMASH_OFFLOAD
+/* Value of map_keymash_fast. Userspace keeps this mmapped and updates it
+ * with plain atomic stores, without a syscall, for experiments that change
+ * the drop rate at kHz rates.
+ */
+struct keymash_fast {
+    /* if non-zero, drop_threshold below replaces the published config's */
+    uint32_t override;
+    uint32_t drop_threshold;
+    /* if non-zero, the filter passes every packet unparsed, see keymash_bypassed */
+    uint32_t bypass;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_fast));
+    __uint(max_entries, 1);
+    // lets userspace mmap the value; only non-per-CPU arrays support this
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_fast __section(".maps");
+#endif
+
+/* Key of map_keymash_flows. A packet is impaired if its L4 protocol and
+ * either its source or destination port (host byte order) match an entry.
+ * The value is the profile the flow is impaired with, see map_keymash_profiles.
+ */
+struct keymash_flow {
+    uint8_t proto;
+    uint8_t pad;
+    uint16_t port;
+};
+
+/* Sized for a few hundred concurrent sessions per host; userspace uses batch
+ * operations to manage them. Mirrored in bpf.rs.
+ */
+#define KEYMASH_MAX_FLOWS	1024
+#define KEYMASH_MAX_PROFILES	1024
+
+struct {
+    // (protocol, port) pairs that should be impaired; everything else passes untouched.
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(key_size, sizeof(struct keymash_flow));
+    // profile id, 0 for the host-wide config in map_keymash
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, KEYMASH_MAX_FLOWS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_flows __section(".maps");
+
+/* Several sessions sharing a NIC each get their own profile, i.e. their own
+ * config, keyed by a profile id. A packet uses the profile of the net_cls
+ * classid of its cgroup if one exists, else the profile of its flow entry.
+ * Profile 0 is not in this map; it stands for the double-buffered config in
+ * map_keymash, which is also the fallback for ids without a profile.
+ *
+ * A hash map update swaps in a whole new element, so profiles can't be seen
+ * half-written and need no generation.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_config));
+    __uint(max_entries, KEYMASH_MAX_PROFILES);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_profiles __section(".maps");
+
+/* What the parsers below extract from a packet. */
+struct keymash_pkt {
+    uint32_t l4_off;
+    uint16_t sport;
+    uint16_t dport;
+    uint8_t proto;
+    /* an IPv4 first fragment: the ports are there, the rest of the datagram isn't */
+    uint8_t first_fragment;
+};
+
+/* the more fragments flag and fragment offset bits of iphdr.frag_off; not
+ * exported by uapi headers
+ */
+#define KEYMASH_IP_MF		0x2000
+#define KEYMASH_IP_OFFSET	0x1fff
+
+static __inline__ int keymash_l4_has_ports(uint8_t proto)
+{
+    return proto == IPPROTO_UDP || proto == IPPROTO_TCP;
+}
+
+/* Parses the L3/L4 headers of an skb with a bounded number of reads.
+ * IPv6 extension headers and non-first fragments are not followed, so such
+ * packets never match a flow. Returns 0 if pkt was filled in.
+ *
+ * Reads past the end of a runt packet abort the program with TC_ACT_OK.
+ */
+static __inline__ int keymash_parse_skb(struct __sk_buff *skb, struct keymash_pkt *pkt)
+{
+    uint32_t ports;
+
+    // too short for any L3 + ports, e.g. ARP; spares the loads below
+    if (skb->len < ETH_HLEN + sizeof(struct iphdr) + sizeof(ports))
+        return -1;
+    if (skb->protocol == htons(ETH_P_IP)) {
+        struct iphdr iph;
+
+        if (skb_load_bytes(skb, ETH_HLEN, &iph, sizeof(iph)) < 0)
+            return -1;
+        if (iph.frag_off & htons(KEYMASH_IP_OFFSET))
+            return -1;
+        pkt->first_fragment = !!(iph.frag_off & htons(KEYMASH_IP_MF));
+        pkt->proto = iph.protocol;
+        pkt->l4_off = ETH_HLEN + (iph.ihl << 2);
+    } else if (skb->protocol == htons(ETH_P_IPV6)) {
+        pkt->first_fragment = 0;
+        pkt->proto = load_byte(skb, ETH_HLEN + offsetof(struct ipv6hdr, nexthdr));
+        pkt->l4_off = ETH_HLEN + sizeof(struct ipv6hdr);
+    } else {
+        return -1;
+    }
+
+    if (!keymash_l4_has_ports(pkt->proto))
+        return -1;
+
+    // source and destination port are the first two halves of both TCP and UDP headers
+    ports = load_word(skb, pkt->l4_off);
+    pkt->sport = ports >> 16;
+    pkt->dport = ports & 0xffff;
+    return 0;
+}
+
+/* Same as keymash_parse_skb, with direct packet access for XDP and offload. */
+static __inline__ int keymash_parse_data(void *data, void *data_end, struct keymash_pkt *pkt)
+{
+    struct ethhdr *eth = data;
+    uint16_t *ports;
+
+    if ((void *)(eth + 1) > data_end)
+        return -1;
+
+    if (eth->h_proto == htons(ETH_P_IP)) {
+        struct iphdr *iph = (void *)(eth + 1);
+
+        if ((void *)(iph + 1) > data_end)
+            return -1;
+        if (iph->frag_off & htons(KEYMASH_IP_OFFSET))
+            return -1;
+        pkt->first_fragment = !!(iph->frag_off & htons(KEYMASH_IP_MF));
+        pkt->proto = iph->protocol;
+        pkt->l4_off = ETH_HLEN + (iph->ihl << 2);
+    } else if (eth->h_proto == htons(ETH_P_IPV6)) {
+        struct ipv6hdr *ip6h = (void *)(eth + 1);
+
+        if ((void *)(ip6h + 1) > data_end)
+            return -1;
+        pkt->first_fragment = 0;
+        pkt->proto = ip6h->nexthdr;
+        pkt->l4_off = ETH_HLEN + sizeof(struct ipv6hdr);
+    } else {
+        return -1;
+    }
+
+    if (!keymash_l4_has_ports(pkt->proto))
+        return -1;
+
+    ports = data + pkt->l4_off;
+    if ((void *)(ports + 2) > data_end)
+        return -1;
+    pkt->sport = ntohs(ports[0]);
+    pkt->dport = ntohs(ports[1]);
+    return 0;
+}
+
+/* Looks the parsed packet up in map_keymash_flows, destination port first.
+ * Returns the flow's profile id if it is targeted, and the matching key in flow.
+ */
+static __inline__ uint32_t *keymash_flow_match(const struct keymash_pkt *pkt,
+                                               struct keymash_flow *flow)
+{
+    uint32_t *profile;
+
+    flow->proto = pkt->proto;
+    flow->pad = 0;
+    flow->port = pkt->dport;
+    profile = map_lookup_elem(&map_keymash_flows, flow);
+    if (profile)
+        return profile;
+    flow->port = pkt->sport;
+    return map_lookup_elem(&map_keymash_flows, flow);
+}
+
+enum keymash_dir {
+    KEYMASH_DIR_INGRESS,
+    KEYMASH_DIR_EGRESS,
+    KEYMASH_DIR_MAX,
+};
+
+enum keymash_verdict {
+    KEYMASH_VERDICT_PASS,
+    KEYMASH_VERDICT_DROP,
+    KEYMASH_VERDICT_MAX,
+};
+
+/* Value of map_keymash_stats, which is indexed by
+ * direction * KEYMASH_VERDICT_MAX + verdict.
+ */
+struct keymash_stats {
+    uint64_t packets;
+    uint64_t bytes;
+    /* wire packets; a GSO/GRO skb counts once in packets but stands for gso_segs of them */
+    uint64_t segments;
+};
+
+struct {
+    // counters of the targeted traffic; per-CPU so the hot path never contends on them
+    __uint(type, KEYMASH_STATS_MAP_TYPE);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_stats));
+    __uint(max_entries, KEYMASH_DIR_MAX * KEYMASH_VERDICT_MAX);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_stats __section(".maps");
+
+static __inline__ void keymash_count(uint32_t dir, uint32_t verdict, uint32_t len, uint32_t segs)
+{
+    uint32_t key = dir * KEYMASH_VERDICT_MAX + verdict;
+    struct keymash_stats *stats;
+
+    stats = map_lookup_elem(&map_keymash_stats, &key);
+    if (stats) {
+#ifdef KEYMASH_OFFLOAD
+        // shared by all of the NIC's threads
+        __sync_fetch_and_add(&stats->packets, 1);
+        __sync_fetch_and_add(&stats->bytes, len);
+        __sync_fetch_and_add(&stats->segments, segs);
+#else
+        stats->packets++;
+        stats->bytes += len;
+        stats->segments += segs;
+#endif
+    }
+}
+
+#ifndef KEYMASH_OFFLOAD
+#ifdef KEYMASH_INSTRUMENT
+#define KEYMASH_LATENCY_BUCKETS	64
+
+struct {
+    // log2 histogram of per-packet run time, indexed by direction * KEYMASH_LATENCY_BUCKETS +
+    // floor(log2(ns)); bucket 0 also holds 0 ns
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint64_t));
+    __uint(max_entries, KEYMASH_DIR_MAX * KEYMASH_LATENCY_BUCKETS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_latency __section(".maps");
+
+struct {
+    // entry timestamp of the packet in flight, per direction. A tail call chain keeps running on
+    // its CPU, and neither side can interrupt itself there, so one slot per direction suffices.
+    // Pinned so that stages loaded from another object (bpf::load_pipeline) read the entry
+    // program's timestamps rather than a map of their own that nothing writes.
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint64_t));
+    __uint(max_entries, KEYMASH_DIR_MAX);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_latency_start __section(".maps");
+
+static __inline__ uint32_t keymash_log2(uint64_t v)
+{
+    uint32_t r = 0;
+
+    if (v >> 32) { v >>= 32; r += 32; }
+    if (v >> 16) { v >>= 16; r += 16; }
+    if (v >> 8) { v >>= 8; r += 8; }
+    if (v >> 4) { v >>= 4; r += 4; }
+    if (v >> 2) { v >>= 2; r += 2; }
+    if (v >> 1) { r += 1; }
+    return r;
+}
+
+static __inline__ void keymash_latency_start(uint32_t dir)
+{
+    uint64_t *start = map_lookup_elem(&map_keymash_latency_start, &dir);
+
+    if (start)
+        *start = ktime_get_ns();
+}
+
+static __inline__ void keymash_latency_end(uint32_t dir)
+{
+    uint64_t *start = map_lookup_elem(&map_keymash_latency_start, &dir), *count;
+    uint32_t key;
+
+    if (!start)
+        return;
+    key = dir * KEYMASH_LATENCY_BUCKETS + keymash_log2(ktime_get_ns() - *start);
+    count = map_lookup_elem(&map_keymash_latency, &key);
+    if (count)
+        (*count)++;
+}
+#else
+static __inline__ void keymash_latency_start(uint32_t dir) {}
+static __inline__ void keymash_latency_end(uint32_t dir) {}
+#endif /* KEYMASH_INSTRUMENT */
+
+struct {
+    // targeted packets seen per flow and CPU, for the seeded mode; LRU so removed flows age out
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(key_size, sizeof(struct keymash_flow));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, KEYMASH_MAX_FLOWS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_seq __section(".maps");
+
+/* Numbers the targeted packets of a flow on this CPU, starting from 0 (or
+ * wherever userspace last cleared map_keymash_seq).
+ */
+static __inline__ uint32_t keymash_packet_index(const struct keymash_flow *flow)
+{
+    uint32_t zero = 0, *count, index;
+
+    count = map_lookup_elem(&map_keymash_seq, flow);
+    if (!count) {
+        map_update_elem(&map_keymash_seq, flow, &zero, BPF_NOEXIST);
+        count = map_lookup_elem(&map_keymash_seq, flow);
+        if (!count)
+            return 0;
+    }
+    index = *count;
+    *count = index + 1;
+    return index;
+}
+
+/* The random numbers a packet may draw, one of each at most. */
+enum keymash_draw {
+    KEYMASH_DRAW_DROP,
+    KEYMASH_DRAW_GE,
+    KEYMASH_DRAW_JITTER,
+    KEYMASH_DRAW_SAMPLE,
+    KEYMASH_DRAW_CORRUPT,
+    KEYMASH_DRAW_CORRUPT_BIT,
+    KEYMASH_DRAW_TRUNCATE,
+    KEYMASH_DRAW_REORDER,
+};
+
+static __inline__ uint64_t keymash_splitmix64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* A uniform random u32 for one draw of a packet. In seeded mode it is a hash
+ * of the seed, the packet's index within its flow and the draw, so the same
+ * seed and traffic give the same verdicts on any machine. The index is
+ * counted per CPU, so this holds as long as RSS keeps each flow on one CPU.
+ */
+static __inline__ uint32_t keymash_random(const struct keymash_config *cfg, uint32_t index,
+                                          uint32_t draw)
+{
+    if (!cfg->seeded)
+        return get_prandom_u32();
+    return keymash_splitmix64(cfg->seed ^ ((uint64_t)index << 8 | draw)) >> 32;
+}
+
+/* The packet index is only counted when it is going to be used. */
+static __inline__ uint32_t keymash_index(const struct keymash_config *cfg,
+                                         const struct keymash_flow *flow)
+{
+    return cfg->seeded ? keymash_packet_index(flow) : 0;
+}
+
+struct {
+    // whether a profile's Gilbert-Elliott chain is in the bad state; one chain per CPU, so no
+    // locking, and LRU so that chains of retired profiles age out
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, KEYMASH_MAX_PROFILES);
+    // pinned so that userspace can restart the chains along with the seeded sequence
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_ge_state __section(".maps");
+
+/* Steps the profile's Gilbert-Elliott chain once per packet and returns the
+ * loss probability of the state it landed in. Mean burst length in the bad
+ * state is 1 / P(exit bad). Since the chain is per-CPU, a flow spread over
+ * several CPUs sees several interleaved chains. good_drop is the loss
+ * probability of the good state.
+ */
+static __inline__ uint32_t keymash_gilbert_elliott(const struct keymash_config *cfg,
+                                                   uint32_t good_drop, uint32_t profile,
+                                                   uint32_t index)
+{
+    uint32_t good = 0, *bad;
+
+    bad = map_lookup_elem(&map_keymash_ge_state, &profile);
+    if (!bad) {
+        map_update_elem(&map_keymash_ge_state, &profile, &good, BPF_NOEXIST);
+        bad = map_lookup_elem(&map_keymash_ge_state, &profile);
+        if (!bad)
+            return 0;
+    }
+
+    if (*bad) {
+        if (keymash_random(cfg, index, KEYMASH_DRAW_GE) < cfg->ge_exit_bad)
+            *bad = 0;
+    } else if (keymash_random(cfg, index, KEYMASH_DRAW_GE) < cfg->ge_enter_bad) {
+        *bad = 1;
+    }
+
+    return *bad ? cfg->ge_bad_drop : good_drop;
+}
+
+/* The drop threshold that the configured model applies to this packet, given
+ * the base drop_threshold (see keymash_ctl_threshold).
+ */
+static __inline__ uint32_t keymash_drop_threshold(const struct keymash_config *cfg,
+                                                  uint32_t drop_threshold, uint32_t profile,
+                                                  uint32_t index)
+{
+    if (cfg->model == KEYMASH_MODEL_GILBERT_ELLIOTT)
+        return keymash_gilbert_elliott(cfg, drop_threshold, profile, index);
+    return drop_threshold;
+}
+
+/* Token bucket of a targeted flow. bpf_spin_lock needs the value type in
+ * BTF, so the map is declared with __type (and bpf.c built with -g).
+ */
+struct keymash_bucket {
+    struct bpf_spin_lock lock;
+    uint32_t pad;
+    uint64_t tokens;
+    uint64_t last_ns;
+};
+
+struct {
+    // one bucket per matched map_keymash_flows entry, created on the flow's first packet
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, struct keymash_flow);
+    __type(value, struct keymash_bucket);
+    __uint(max_entries, KEYMASH_MAX_FLOWS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_buckets __section(".maps");
+
+#define NSEC_PER_SEC	1000000000ULL
+
+/* Charges len bytes to the flow's bucket, refilled at rate_bytes_per_sec up
+ * to burst_bytes. Returns 1 if the packet is over budget.
+ */
+static __inline__ int keymash_over_rate(const struct keymash_config *cfg,
+                                        const struct keymash_flow *flow, uint32_t len)
 {
-    uint32_t key = 0, *val = 0;
+    struct keymash_bucket *bucket, fresh = {};
+    uint64_t now = ktime_get_ns(), elapsed, fill_ns, refill;
+    int over;
+
+    bucket = map_lookup_elem(&map_keymash_buckets, flow);
+    if (!bucket) {
+        fresh.tokens = cfg->burst_bytes;
+        fresh.last_ns = now;
+        map_update_elem(&map_keymash_buckets, flow, &fresh, BPF_NOEXIST);
+        bucket = map_lookup_elem(&map_keymash_buckets, flow);
+        if (!bucket)
+            return 0;
+    }
+
+    spin_lock(&bucket->lock);
+    elapsed = now - bucket->last_ns;
+    // an idle bucket is full after fill_ns; below that, elapsed * rate stays within burst * 10^9
+    fill_ns = cfg->burst_bytes * NSEC_PER_SEC / cfg->rate_bytes_per_sec;
+    if (elapsed > fill_ns)
+        refill = cfg->burst_bytes;
+    else
+        refill = elapsed * cfg->rate_bytes_per_sec / NSEC_PER_SEC;
+    // leave last_ns alone until a whole byte has accrued, so slow rates still refill
+    if (refill) {
+        bucket->tokens += refill;
+        bucket->last_ns = now;
+    }
+    if (bucket->tokens > cfg->burst_bytes)
+        bucket->tokens = cfg->burst_bytes;
+    over = bucket->tokens < len;
+    if (!over)
+        bucket->tokens -= len;
+    spin_unlock(&bucket->lock);
+
+    return over;
+}
+
+/* State of a profile's loss controller. Unlike the Gilbert-Elliott chain it is
+ * shared by all CPUs, since it has to see all of the profile's traffic to
+ * steer it; it is only touched while a controller mode is set.
+ */
+struct keymash_ctl {
+    struct bpf_spin_lock lock;
+    /* the drop threshold currently applied in place of the config's */
+    uint32_t threshold;
+    uint64_t window_start_ns;
+    /* targeted wire packets and bytes that got a verdict in the current window, and how many passed */
+    uint64_t packets;
+    uint64_t dropped;
+    uint64_t bytes;
+    uint64_t passed_bytes;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, uint32_t);
+    __type(value, struct keymash_ctl);
+    __uint(max_entries, KEYMASH_MAX_PROFILES);
+    // pinned so that userspace can read the applied threshold, or reset the controllers
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_ctl __section(".maps");
+
+/* the controller waits for at least this many verdicts per window, so slow flows aren't steered by noise */
+#define KEYMASH_CTL_MIN_PACKETS	16
+
+/* The drop threshold to apply in place of cfg->drop_threshold: the one the
+ * profile's controller has settled on, if a controller mode is set. A new
+ * controller starts out at the target loss, or at no loss for a target rate.
+ */
+static __inline__ uint32_t keymash_ctl_threshold(const struct keymash_config *cfg, uint32_t profile)
+{
+    struct keymash_ctl *ctl, fresh = {};
+
+    if (cfg->ctl_mode == KEYMASH_CTL_OFF)
+        return cfg->drop_threshold;
+    ctl = map_lookup_elem(&map_keymash_ctl, &profile);
+    if (!ctl) {
+        fresh.threshold = cfg->ctl_mode == KEYMASH_CTL_LOSS ? cfg->drop_threshold : 0;
+        fresh.window_start_ns = ktime_get_ns();
+        map_update_elem(&map_keymash_ctl, &profile, &fresh, BPF_NOEXIST);
+        ctl = map_lookup_elem(&map_keymash_ctl, &profile);
+        if (!ctl)
+            return fresh.threshold;
+    }
+    // a lone u32, so a racing update is seen either whole or not at all
+    return *(volatile uint32_t *)&ctl->threshold;
+}
+
+/* part / total in units of 2^32, for part <= total. Past 4 GiB part << 32
+ * would overflow, so both lose low bits first; total keeps at least 16 bits.
+ */
+static __inline__ uint64_t keymash_ctl_share(uint64_t part, uint64_t total)
+{
+    if (total >> 48) {
+        part >>= 16;
+        total >>= 16;
+    }
+    if (total >> 32) {
+        part >>= 16;
+        total >>= 16;
+    }
+    return (part << 32) / total;
+}
+
+/* Counts a verdict towards the profile's controller and, once a window is
+ * over, moves the threshold by half of the observed error, in threshold units:
+ * the share of the window's packets to drop additionally (or fewer). This
+ * integral step corrects for whatever else is dropping packets (shaping,
+ * sequence classes, Gilbert-Elliott bursts) as the traffic changes, with no
+ * userspace involvement. In rate mode the error is the share of the offered
+ * bytes that passed in excess of the target. Loss is counted in wire packets,
+ * so a dropped GSO skb weighs as much as the segments it carried.
+ */
+static __inline__ void keymash_ctl_update(const struct keymash_config *cfg, uint32_t profile,
+                                          uint32_t verdict, uint32_t len, uint32_t segs)
+{
+    uint64_t now, elapsed, target, measured, over, under, total;
+    struct keymash_ctl *ctl;
+    int64_t threshold;
+
+    if (cfg->ctl_mode == KEYMASH_CTL_OFF)
+        return;
+    ctl = map_lookup_elem(&map_keymash_ctl, &profile);
+    if (!ctl)
+        return;
+    now = ktime_get_ns();
+
+    spin_lock(&ctl->lock);
+    ctl->packets += segs;
+    ctl->bytes += len;
+    if (verdict == KEYMASH_VERDICT_DROP)
+        ctl->dropped += segs;
+    else
+        ctl->passed_bytes += len;
+
+    elapsed = now - ctl->window_start_ns;
+    if (elapsed < cfg->ctl_interval_ns || ctl->packets < KEYMASH_CTL_MIN_PACKETS)
+        goto unlock;
+    // an idle gap says nothing about the rate
+    if (elapsed > NSEC_PER_SEC)
+        elapsed = NSEC_PER_SEC;
+
+    if (cfg->ctl_mode == KEYMASH_CTL_LOSS) {
+        target = cfg->drop_threshold;
+        measured = keymash_ctl_share(ctl->dropped, ctl->packets);
+        over = target > measured ? target - measured : 0;
+        under = measured > target ? measured - target : 0;
+    } else {
+        // split so that neither product overflows, whatever the target rate
+        target = cfg->ctl_target_rate / NSEC_PER_SEC * elapsed +
+                 cfg->ctl_target_rate % NSEC_PER_SEC * elapsed / NSEC_PER_SEC;
+        total = ctl->bytes;
+        over = ctl->passed_bytes > target ? ctl->passed_bytes - target : 0;
+        under = target > ctl->passed_bytes ? target - ctl->passed_bytes : 0;
+        // a target above the offered load can't be reached; don't wind up past it
+        if (under > total)
+            under = total;
+        over = keymash_ctl_share(over, total);
+        under = keymash_ctl_share(under, total);
+    }
+    threshold = (int64_t)ctl->threshold + (int64_t)(over >> 1) - (int64_t)(under >> 1);
+    if (threshold < 0)
+        threshold = 0;
+    if (threshold > UINT32_MAX)
+        threshold = UINT32_MAX;
+    ctl->threshold = threshold;
+
+    ctl->window_start_ns = now;
+    ctl->packets = 0;
+    ctl->dropped = 0;
+    ctl->bytes = 0;
+    ctl->passed_bytes = 0;
+unlock:
+    spin_unlock(&ctl->lock);
+}
+
+/* A drop threshold set through map_keymash_fast takes precedence. */
+static __inline__ void keymash_config_fast(struct keymash_config *cfg)
+{
+    uint32_t key = 0;
+    struct keymash_fast *fast;
+
+    fast = map_lookup_elem(&map_keymash_fast, &key);
+    if (fast && fast->override)
+        cfg->drop_threshold = fast->drop_threshold;
+}
+
+struct {
+    // packets let through by the bypass flag, per direction; they are in no other map
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint64_t));
+    __uint(max_entries, KEYMASH_DIR_MAX);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_bypassed __section(".maps");
+
+/* Hosts mostly run with no impairment at all. Userspace then sets the bypass
+ * flag, and the entry points pass every packet before parsing it, at the cost
+ * of two lookups and a per-CPU increment in map_keymash_bypassed. Nothing else
+ * sees these packets: not the stats, feedback, events or latency histogram,
+ * nor the profiles and controllers, so only set the flag while none of them
+ * is in use.
+ */
+static __inline__ int keymash_bypassed(uint32_t dir)
+{
+    uint32_t key = 0;
+    struct keymash_fast *fast;
+    uint64_t *count;
+
+    fast = map_lookup_elem(&map_keymash_fast, &key);
+    if (!fast || !fast->bypass)
+        return 0;
+    count = map_lookup_elem(&map_keymash_bypassed, &dir);
+    if (count)
+        (*count)++;
+    return 1;
+}
+
+/* A recorded network trace can be replayed as a schedule of steps, each
+ * taking effect at a given time, without userspace timing each change.
+ * Userspace writes the steps into map_keymash_schedule, used as a ring, and
+ * publishes the range of indices it holds in map_keymash_schedule_state; it
+ * refills the ring from the trace as the steps fall behind. The filter only
+ * reads both maps, so there is nothing to race on.
+ */
+#define KEYMASH_SCHEDULE_STEPS	4096
+/* a CPU moves its cursor by at most this many steps per packet, so one that
+ * has been idle through many steps catches up over a few packets */
+#define KEYMASH_SCHEDULE_SCAN	32
+
+struct keymash_step {
+    /* time after the schedule's start_ns when the step takes effect */
+    uint64_t at_ns;
+    /* replace the fields of the same name in the config */
+    uint64_t rate_bytes_per_sec;
+    uint64_t delay_ns;
+    uint32_t drop_threshold;
+    uint32_t jitter_ns;
+    uint32_t burst_bytes;
+    uint32_t pad;
+};
+
+struct keymash_schedule {
+    /* ktime_get_ns() at which the schedule starts */
+    uint64_t start_ns;
+    /* index of the oldest step still in the ring, and one past the newest;
+     * step i sits in slot i % KEYMASH_SCHEDULE_STEPS, and tail == head means
+     * no schedule is playing */
+    uint64_t tail;
+    uint64_t head;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_step));
+    __uint(max_entries, KEYMASH_SCHEDULE_STEPS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_schedule __section(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_schedule));
+    __uint(max_entries, 1);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_schedule_state __section(".maps");
+
+struct {
+    // index of the step this CPU last applied; per-CPU, so the cursors need no locking
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint64_t));
+    __uint(max_entries, 1);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_schedule_pos __section(".maps");
+
+/* While a schedule plays, the step it has reached replaces the loss, shaping
+ * and delay parameters of the host-wide config.
+ */
+static __inline__ void keymash_config_schedule(struct keymash_config *cfg)
+{
+    uint32_t key = 0, slot;
+    struct keymash_schedule *sched;
+    struct keymash_step *step;
+    uint64_t *pos, index, tail, head, now;
+    int i;
+
+    sched = map_lookup_elem(&map_keymash_schedule_state, &key);
+    if (!sched)
+        return;
+    tail = sched->tail;
+    head = sched->head;
+    now = ktime_get_ns();
+    if (tail >= head || now < sched->start_ns)
+        return;
+    now -= sched->start_ns;
+    pos = map_lookup_elem(&map_keymash_schedule_pos, &key);
+    if (!pos)
+        return;
+
+    // a cursor outside the ring belongs to an earlier schedule, or fell behind a refill
+    index = *pos;
+    if (index < tail || index >= head)
+        index = tail;
+    for (i = 0; i < KEYMASH_SCHEDULE_SCAN && index + 1 < head; i++) {
+        slot = (index + 1) % KEYMASH_SCHEDULE_STEPS;
+        step = map_lookup_elem(&map_keymash_schedule, &slot);
+        if (!step || step->at_ns > now)
+            break;
+        index++;
+    }
+    *pos = index;
+
+    slot = index % KEYMASH_SCHEDULE_STEPS;
+    step = map_lookup_elem(&map_keymash_schedule, &slot);
+    // before the first step, the config applies as published
+    if (!step || step->at_ns > now)
+        return;
+    cfg->drop_threshold = step->drop_threshold;
+    cfg->rate_bytes_per_sec = step->rate_bytes_per_sec;
+    cfg->burst_bytes = step->burst_bytes;
+    cfg->delay_ns = step->delay_ns;
+    cfg->jitter_ns = step->jitter_ns;
+}
+
+/* Sized for many-core boxes; CPUs, queues or nodes past it are never impaired
+ * or counted on their own. Mirrored in bpf.rs.
+ */
+#define KEYMASH_MAX_UNITS	256
+
+/* Per-unit drop thresholds, to impair one RX queue, CPU or NUMA node (a unit,
+ * per the config's scope) and watch how RSS steering and the receiver's
+ * thread placement respond.
+ */
+struct keymash_unit {
+    /* if non-zero, drop_threshold replaces the config's for the unit's packets */
+    uint32_t override;
+    uint32_t drop_threshold;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_unit));
+    __uint(max_entries, KEYMASH_MAX_UNITS);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_units __section(".maps");
+
+struct {
+    // like map_keymash_stats, indexed by (unit * KEYMASH_DIR_MAX + direction) * KEYMASH_VERDICT_MAX + verdict
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_stats));
+    __uint(max_entries, KEYMASH_MAX_UNITS * KEYMASH_DIR_MAX * KEYMASH_VERDICT_MAX);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_unit_stats __section(".maps");
+
+/* The unit that processes a packet under the config's scope. queue is the
+ * packet's RX queue, or its TX queue on egress.
+ */
+static __inline__ uint32_t keymash_unit(const struct keymash_config *cfg, uint32_t queue)
+{
+    switch (cfg->scope) {
+    case KEYMASH_SCOPE_QUEUE:
+        return queue;
+    case KEYMASH_SCOPE_CPU:
+        return get_smp_processor_id();
+    case KEYMASH_SCOPE_NODE:
+        return get_numa_node_id();
+    }
+    return 0;
+}
+
+static __inline__ uint32_t keymash_queue_skb(const struct __sk_buff *skb, uint32_t dir)
+{
+    // drivers record the RX queue plus one, so that 0 means none was recorded
+    if (dir == KEYMASH_DIR_INGRESS)
+        return skb->queue_mapping ? skb->queue_mapping - 1 : 0;
+    return skb->queue_mapping;
+}
+
+/* The unit's threshold, if it has one, in place of the base threshold. A
+ * controller steers all of a profile's traffic as one, so it takes precedence.
+ */
+static __inline__ uint32_t keymash_unit_threshold(const struct keymash_config *cfg,
+                                                  uint32_t threshold, uint32_t unit)
+{
+    struct keymash_unit *override;
+
+    if (cfg->scope == KEYMASH_SCOPE_HOST || cfg->ctl_mode != KEYMASH_CTL_OFF)
+        return threshold;
+    override = map_lookup_elem(&map_keymash_units, &unit);
+    if (override && override->override)
+        return override->drop_threshold;
+    return threshold;
+}
+
+static __inline__ void keymash_count_unit(const struct keymash_config *cfg, uint32_t unit,
+                                          uint32_t dir, uint32_t verdict, uint32_t len,
+                                          uint32_t segs)
+{
+    uint32_t key = (unit * KEYMASH_DIR_MAX + dir) * KEYMASH_VERDICT_MAX + verdict;
+    struct keymash_stats *stats;
+
+    if (cfg->scope == KEYMASH_SCOPE_HOST || unit >= KEYMASH_MAX_UNITS)
+        return;
+    stats = map_lookup_elem(&map_keymash_unit_stats, &key);
+    if (stats) {
+        stats->packets++;
+        stats->bytes += len;
+        stats->segments += segs;
+    }
+}
+
+/* Loss and rate counters for a sender on this host to adapt to at once,
+ * rather than a round trip later when the receiver reports back. Userspace
+ * mmaps the map and sums the entries of all CPUs without a syscall. Each CPU
+ * has its own entry per direction, a cache line each, so the CPUs don't
+ * contend on them.
+ */
+struct keymash_feedback {
+    /* wire packets, see keymash_segs */
+    uint64_t packets;
+    uint64_t dropped;
+    uint64_t bytes;
+    uint64_t passed_bytes;
+    uint64_t pad[4];
+};
 
-    val = map_lookup_elem(&map_keymash, &key);
-    if (val && get_prandom_u32() < *val) {
+struct {
+    // indexed by CPU * KEYMASH_DIR_MAX + direction
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(struct keymash_feedback));
+    __uint(max_entries, KEYMASH_MAX_UNITS * KEYMASH_DIR_MAX);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_feedback __section(".maps");
+
+static __inline__ void keymash_feedback(uint32_t dir, uint32_t verdict, uint32_t len, uint32_t segs)
+{
+    uint32_t key = get_smp_processor_id() * KEYMASH_DIR_MAX + dir;
+    struct keymash_feedback *fb;
+
+    fb = map_lookup_elem(&map_keymash_feedback, &key);
+    if (!fb)
+        return;
+    // only this CPU writes the entry, and a u64 store is never seen torn; the
+    // fields are separate stores, though, so a reader may see one without another
+    fb->packets += segs;
+    fb->bytes += len;
+    if (verdict == KEYMASH_VERDICT_DROP)
+        fb->dropped += segs;
+    else
+        fb->passed_bytes += len;
+}
+
+#endif /* KEYMASH_OFFLOAD */
+
+/* Keeps the compiler from moving the loads of a config copy across the loads
+ * of map_keymash_active around it. BPF has no load barrier instruction, so
+ * on CPUs that reorder loads (unlike x86) the check is only as strict as the
+ * JIT's code happens to be.
+ */
+#define keymash_barrier()	asm volatile("" ::: "memory")
+
+/* Attempts of keymash_config_load to find a slot that is not being rewritten */
+#define KEYMASH_CONFIG_RETRIES	4
+
+/* Copies slot generation % 2 of map_keymash onto the stack, if it still holds
+ * that generation. This is the read side of a seqlock whose sequence is
+ * map_keymash_active: userspace writes generation g + 1 into the idle slot and
+ * only then bumps map_keymash_active to g + 1, so slot g % 2 is only rewritten
+ * (non-atomically, by the map update) once map_keymash_active has moved past
+ * g. A copy is whole if map_keymash_active still reads g after it, and both
+ * ends of the copy read g. Each end only catches a map update that got
+ * partway, so the re-read is what actually decides.
+ */
+static __inline__ int keymash_config_copy(struct keymash_config *cfg, uint32_t *active,
+                                          uint32_t generation)
+{
+    uint32_t slot = generation & 1;
+    struct keymash_config *published;
+
+    published = map_lookup_elem(&map_keymash, &slot);
+    if (!published)
+        return -1;
+    memcpy(cfg, published, sizeof(*cfg));
+    keymash_barrier();
+    if (cfg->generation != generation || cfg->generation_end != generation ||
+        *(volatile uint32_t *)active != generation)
+        return -1;
+    return 0;
+}
+
+/* Copies the live config onto the stack, so that every stage of this packet
+ * sees the same parameters; see keymash_config_copy. Publications are rare,
+ * so a few retries always find a quiet moment; should they not, the packet
+ * passes unimpaired rather than with a torn config.
+ */
+static __inline__ int keymash_config_load(struct keymash_config *cfg)
+{
+    uint32_t key = 0, generation, *active;
+    int i;
+
+    active = map_lookup_elem(&map_keymash_active, &key);
+    if (!active)
+        return -1;
+#pragma unroll
+    for (i = 0; i < KEYMASH_CONFIG_RETRIES; i++) {
+        generation = *(volatile uint32_t *)active;
+        keymash_barrier();
+        if (!keymash_config_copy(cfg, active, generation))
+            goto loaded;
+    }
+    return -1;
+
+loaded:
+#ifndef KEYMASH_OFFLOAD
+    keymash_config_fast(cfg);
+    keymash_config_schedule(cfg);
+#endif
+    return 0;
+}
+
+/* Copies the config of a profile onto the stack, falling back to the
+ * host-wide config if the profile does not exist. map_keymash_fast and
+ * schedules only override the host-wide config.
+ */
+static __inline__ int keymash_profile_load(struct keymash_config *cfg, uint32_t profile)
+{
+    struct keymash_config *published;
+
+    if (profile) {
+        published = map_lookup_elem(&map_keymash_profiles, &profile);
+        if (published) {
+            memcpy(cfg, published, sizeof(*cfg));
+            return 0;
+        }
+    }
+    return keymash_config_load(cfg);
+}
+
+#ifndef KEYMASH_OFFLOAD
+/* The profile of a targeted skb; flow_profile is its map_keymash_flows value.
+ * Only sockets in a net_cls cgroup have a classid, so this mostly helps on egress.
+ */
+static __inline__ uint32_t keymash_profile_skb(struct __sk_buff *skb, const uint32_t *flow_profile)
+{
+    uint32_t classid = get_cgroup_classid(skb);
+
+    if (classid && map_lookup_elem(&map_keymash_profiles, &classid))
+        return classid;
+    return *flow_profile;
+}
+
+/* Sequence-number classes let a share of the stream (e.g. every 8th packet)
+ * be protected or sacrificed on its own, as priority-aware networks do. The
+ * Gilbert-Elliott chain has already stepped, so it is unaffected. Only UDP
+ * carries the RTP-like header.
+ */
+static __inline__ uint32_t keymash_class_threshold(const struct keymash_config *cfg,
+                                                   uint32_t threshold,
+                                                   const struct keymash_pkt *pkt, uint32_t rtp_seq)
+{
+    if (cfg->seq_class_every && pkt->proto == IPPROTO_UDP &&
+        rtp_seq % cfg->seq_class_every == 0)
+        return cfg->seq_class_threshold;
+    return threshold;
+}
+
+/* The verdict of the XDP entry point: random loss first, then
+ * shaping of the packets that survived it. The applied loss threshold is
+ * stored in threshold.
+ */
+static __inline__ uint32_t keymash_decide(const struct keymash_config *cfg, uint32_t profile,
+                                          const struct keymash_flow *flow,
+                                          const struct keymash_pkt *pkt, uint32_t len,
+                                          uint32_t index, uint32_t unit, uint32_t rtp_seq,
+                                          uint32_t *threshold)
+{
+    *threshold = keymash_unit_threshold(cfg, keymash_ctl_threshold(cfg, profile), unit);
+    *threshold = keymash_drop_threshold(cfg, *threshold, profile, index);
+    *threshold = keymash_class_threshold(cfg, *threshold, pkt, rtp_seq);
+    // no draw at zero loss; draws are independent of each other, so seeded runs are unaffected
+    if (*threshold && keymash_random(cfg, index, KEYMASH_DRAW_DROP) < *threshold)
+        return KEYMASH_VERDICT_DROP;
+    if (cfg->rate_bytes_per_sec && keymash_over_rate(cfg, flow, len))
+        return KEYMASH_VERDICT_DROP;
+    return KEYMASH_VERDICT_PASS;
+}
+
+/* A sampled drop decision, see map_keymash_events. */
+struct keymash_event {
+    uint64_t tstamp_ns;
+    uint32_t len;
+    uint32_t threshold;
+    /* sequence number of the RTP-like header for UDP, 0 otherwise (see rtp.rs) */
+    uint32_t rtp_seq;
+    uint8_t dir;
+    uint8_t verdict;
+    /* the port that matched map_keymash_flows */
+    uint16_t port;
+};
+
+struct {
+    // sampled decisions for userspace analysis; mmapped by the consumer in bpf.rs
+    __uint(type, BPF_MAP_TYPE_RINGBUF);
+    __uint(max_entries, 256 * 1024);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_events __section(".maps");
+
+static __inline__ int keymash_sampled(const struct keymash_config *cfg, uint32_t index)
+{
+    return cfg->event_sample_every &&
+           keymash_random(cfg, index, KEYMASH_DRAW_SAMPLE) % cfg->event_sample_every == 0;
+}
+
+/* Reports a decision to userspace. If the ring is full, the event is lost. */
+static __inline__ void keymash_emit(uint32_t dir, uint32_t verdict, uint32_t threshold,
+                                    uint32_t len, const struct keymash_flow *flow,
+                                    uint32_t rtp_seq)
+{
+    struct keymash_event *ev;
+
+    ev = ringbuf_reserve(&map_keymash_events, sizeof(*ev), 0);
+    if (!ev)
+        return;
+    ev->tstamp_ns = ktime_get_ns();
+    ev->len = len;
+    ev->threshold = threshold;
+    ev->rtp_seq = rtp_seq;
+    ev->dir = dir;
+    ev->verdict = verdict;
+    ev->port = flow->port;
+    ringbuf_submit(ev, 0);
+}
+
+/* The sequence number sits right after the UDP header, in network byte order. */
+static __inline__ uint32_t keymash_rtp_seq_skb(struct __sk_buff *skb, const struct keymash_pkt *pkt)
+{
+    uint32_t seq;
+
+    if (pkt->proto != IPPROTO_UDP ||
+        skb_load_bytes(skb, pkt->l4_off + sizeof(struct udphdr), &seq, sizeof(seq)) < 0)
+        return 0;
+    return ntohl(seq);
+}
+
+static __inline__ uint32_t keymash_rtp_seq_xdp(struct xdp_md *ctx, const struct keymash_pkt *pkt)
+{
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    uint32_t *seq = data + pkt->l4_off + sizeof(struct udphdr);
+
+    if (pkt->proto != IPPROTO_UDP || (void *)(seq + 1) > data_end)
+        return 0;
+    return ntohl(*seq);
+}
+
+/* Earliest departure time: the fq qdisc (see setup-tc.sh) holds each packet
+ * until skb->tstamp, so the delay costs no memory in the application. fq
+ * orders a flow's packets by departure time, so jitter can reorder them.
+ */
+static __inline__ void keymash_delay(struct __sk_buff *skb, const struct keymash_config *cfg,
+                                     uint32_t index)
+{
+    uint64_t now, tstamp;
+
+    if (!cfg->delay_ns && !cfg->jitter_ns)
+        return;
+
+    // keep any departure time the stack already set (e.g. TCP pacing) as the base
+    now = ktime_get_ns();
+    tstamp = skb->tstamp > now ? skb->tstamp : now;
+    tstamp += cfg->delay_ns;
+    if (cfg->jitter_ns)
+        tstamp += keymash_random(cfg, index, KEYMASH_DRAW_JITTER) % cfg->jitter_ns;
+    skb->tstamp = tstamp;
+}
+
+/* Holds a packet back behind the ones that follow it within reorder_ns. fq
+ * sends a flow's packets in departure time order, so the reorder depth is
+ * the number of packets the flow sends in that time.
+ */
+static __inline__ void keymash_reorder(struct __sk_buff *skb, const struct keymash_config *cfg)
+{
+    uint64_t now = ktime_get_ns();
+
+    // on top of the delay stage's departure time, if it ran first
+    skb->tstamp = (skb->tstamp > now ? skb->tstamp : now) + cfg->reorder_ns;
+}
+
+/* Flips one bit of the UDP payload, RTP-like header included, so that the
+ * receiver's validation sees garbage. The checksum is patched through the
+ * 16-bit word around the flipped byte; l4_off is always even, so that word
+ * is aligned like the checksum's. The last byte of an odd-length payload has
+ * no second byte, and the checksum pads it with a zero one, as is old's.
+ * A UDP checksum of 0 means "none" and stays.
+ */
+static __inline__ void keymash_corrupt(struct __sk_buff *skb, const struct keymash_config *cfg,
+                                       const struct keymash_pkt *pkt, uint32_t index)
+{
+    uint32_t payload_off = pkt->l4_off + sizeof(struct udphdr);
+    uint32_t csum_off = pkt->l4_off + offsetof(struct udphdr, check);
+    uint32_t bit, off, len;
+    uint16_t old = 0, new, csum;
+
+    if (pkt->proto != IPPROTO_UDP || skb->len <= payload_off)
+        return;
+
+    bit = keymash_random(cfg, index, KEYMASH_DRAW_CORRUPT_BIT) % ((skb->len - payload_off) * 8);
+    off = (payload_off + bit / 8) & ~1;
+    len = off + sizeof(old) > skb->len ? 1 : sizeof(old);
+    if (skb_load_bytes(skb, off, &old, len) < 0)
+        return;
+    // the bit within the word, counted in memory order; in the first byte if it's the only one
+    new = old ^ htons(0x8000 >> (bit & 15));
+    if (skb_store_bytes(skb, off, &new, len, 0) < 0)
+        return;
+
+    if (!cfg->corrupt_fix_csum ||
+        skb_load_bytes(skb, csum_off, &csum, sizeof(csum)) < 0 || !csum)
+        return;
+    l4_csum_replace(skb, csum_off, old, new, BPF_F_MARK_MANGLED_0 | sizeof(new));
+}
+
+/* The UDP checksum a CHECKSUM_PARTIAL skb carries until it is completed: the
+ * pseudo header's sum alone. __sk_buff doesn't expose ip_summed, so matching
+ * this seed is how keymash_truncate tells such an skb apart; one with a
+ * complete checksum matches it by chance about once in 65536.
+ */
+static __inline__ int keymash_udp_csum_partial(struct __sk_buff *skb, uint16_t udp_len,
+                                               uint16_t csum)
+{
+    struct {
+        uint32_t saddr;
+        uint32_t daddr;
+        uint8_t zero;
+        uint8_t proto;
+        uint16_t len;
+    } ph;
+    uint32_t sum;
+
+    if (skb_load_bytes(skb, ETH_HLEN + offsetof(struct iphdr, saddr), &ph, 2 * sizeof(uint32_t)) < 0)
+        return 0;
+    ph.zero = 0;
+    ph.proto = IPPROTO_UDP;
+    ph.len = udp_len;
+    sum = csum_diff((void *)0, 0, &ph, sizeof(ph), 0);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return csum == sum;
+}
+
+/* Cuts the UDP payload down to truncate_len bytes. The IPv4 and UDP length
+ * fields are shrunk to match, or the stack would discard the packet. A
+ * complete UDP checksum can't be patched for the removed bytes, so it is
+ * cleared, which IPv4 allows and IPv6 does not; a CHECKSUM_PARTIAL one only
+ * covers the pseudo header yet, and gets its length patched.
+ */
+static __inline__ void keymash_truncate(struct __sk_buff *skb, const struct keymash_config *cfg,
+                                        const struct keymash_pkt *pkt)
+{
+    uint32_t len = pkt->l4_off + sizeof(struct udphdr) + cfg->truncate_len;
+    uint32_t tot_len_off = ETH_HLEN + offsetof(struct iphdr, tot_len);
+    uint32_t udp_len_off = pkt->l4_off + offsetof(struct udphdr, len);
+    uint32_t csum_off = pkt->l4_off + offsetof(struct udphdr, check);
+    uint16_t old_tot_len, tot_len, old_udp_len, udp_len, csum;
+    int partial;
+
+    if (pkt->proto != IPPROTO_UDP || skb->protocol != htons(ETH_P_IP) || len >= skb->len)
+        return;
+    if (skb_load_bytes(skb, tot_len_off, &old_tot_len, sizeof(old_tot_len)) < 0 ||
+        skb_load_bytes(skb, udp_len_off, &old_udp_len, sizeof(old_udp_len)) < 0 ||
+        skb_load_bytes(skb, csum_off, &csum, sizeof(csum)) < 0)
+        return;
+    partial = keymash_udp_csum_partial(skb, old_udp_len, csum);
+    if (skb_change_tail(skb, len, 0) < 0)
+        return;
+
+    tot_len = htons(len - ETH_HLEN);
+    skb_store_bytes(skb, tot_len_off, &tot_len, sizeof(tot_len), 0);
+    l3_csum_replace(skb, ETH_HLEN + offsetof(struct iphdr, check), old_tot_len, tot_len,
+                    sizeof(tot_len));
+    udp_len = htons(len - pkt->l4_off);
+    skb_store_bytes(skb, udp_len_off, &udp_len, sizeof(udp_len), 0);
+    if (partial) {
+        l4_csum_replace(skb, csum_off, old_udp_len, udp_len, BPF_F_PSEUDO_HDR | sizeof(udp_len));
+    } else {
+        csum = 0;
+        skb_store_bytes(skb, csum_off, &csum, sizeof(csum), 0);
+    }
+}
+
+/* The tc classifier is a pipeline of stages chained with tail calls. The
+ * entry programs below only classify the packet and jump into slot 0 of
+ * map_keymash_pipeline; each stage then jumps into the next slot. Userspace
+ * fills the slots densely with the stages it needs (see bpf.rs), so a
+ * disabled feature costs nothing, and each stage is verified on its own.
+ *
+ * The stage programs are loaded by userspace, not by tc, and share the maps
+ * pinned in tc/globals. A tail call into an empty slot falls through, which
+ * ends the pipeline with a pass verdict.
+ */
+enum keymash_stage {
+    KEYMASH_STAGE_DROP,
+    KEYMASH_STAGE_SHAPE,
+    KEYMASH_STAGE_DELAY,
+    KEYMASH_STAGE_CORRUPT,
+    KEYMASH_STAGE_TRUNCATE,
+    KEYMASH_STAGE_REORDER,
+    KEYMASH_STAGE_MAX,
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, KEYMASH_STAGE_MAX);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_pipeline __section(".maps");
+
+/* Per-packet state handed from stage to stage in skb->cb, which survives
+ * tail calls.
+ */
+enum keymash_cb {
+    /* slot of map_keymash_pipeline to run next, plus the low bits of the config's
+     * generation from KEYMASH_CB_POS_GENERATION up */
+    KEYMASH_CB_POS,
+    /* direction and the matched struct keymash_flow, as dir << 24 | proto << 16 | port */
+    KEYMASH_CB_FLOW,
+    /* the packet's profile, see map_keymash_profiles */
+    KEYMASH_CB_PROFILE,
+    /* loss threshold applied by the drop stage, for map_keymash_events */
+    KEYMASH_CB_THRESHOLD,
+    /* the packet's index within its flow, see keymash_random */
+    KEYMASH_CB_INDEX,
+};
+
+/* shift of the generation in KEYMASH_CB_POS, below which the slot to run next sits */
+#define KEYMASH_CB_POS_GENERATION	16
+
+static __inline__ uint32_t keymash_cb_dir(const struct __sk_buff *skb)
+{
+    return skb->cb[KEYMASH_CB_FLOW] >> 24;
+}
+
+static __inline__ void keymash_cb_flow(const struct __sk_buff *skb, struct keymash_flow *flow)
+{
+    uint32_t packed = skb->cb[KEYMASH_CB_FLOW];
+
+    flow->proto = (packed >> 16) & 0xff;
+    flow->pad = 0;
+    flow->port = packed & 0xffff;
+}
+
+/* Stages reload the host-wide config the entry program saw from its slot,
+ * rather than the live one, so a publication in between does not mix
+ * parameters. Once a second publication has started to rewrite that slot,
+ * they take the live config instead. A profile is simply looked up again.
+ */
+static __inline__ int keymash_stage_config(const struct __sk_buff *skb,
+                                           struct keymash_config *cfg)
+{
+    uint32_t seen = skb->cb[KEYMASH_CB_POS] >> KEYMASH_CB_POS_GENERATION;
+    uint32_t key = 0, profile = skb->cb[KEYMASH_CB_PROFILE], generation, *active;
+    struct keymash_config *published;
+
+    if (profile) {
+        published = map_lookup_elem(&map_keymash_profiles, &profile);
+        if (published) {
+            memcpy(cfg, published, sizeof(*cfg));
+            return 0;
+        }
+    }
+    active = map_lookup_elem(&map_keymash_active, &key);
+    if (!active)
+        return -1;
+    generation = *(volatile uint32_t *)active;
+    keymash_barrier();
+    // still the entry program's generation, which keymash_config_copy checks in full
+    if ((generation & 0xffff) != seen || keymash_config_copy(cfg, active, generation))
+        return keymash_config_load(cfg);
+    keymash_config_fast(cfg);
+    keymash_config_schedule(cfg);
+    return 0;
+}
+
+/* Number of wire packets an skb stands for. With GSO on egress (e.g. UDP_SEGMENT
+ * sends, see rtp.rs) or GRO on ingress, one skb carries gso_segs segments, and
+ * a verdict applies to all of them: the per-segment loss rate stays that of the
+ * model, but losses come in bursts of up to gso_segs. The stats and the
+ * controller count segments, so that they report the loss seen on the wire.
+ */
+static __inline__ uint32_t keymash_segs(const struct __sk_buff *skb)
+{
+    return skb->gso_segs > 1 ? skb->gso_segs : 1;
+}
+
+/* Accounts for the final verdict of a packet and turns it into a tc action. */
+static __inline__ int keymash_finish(struct __sk_buff *skb, const struct keymash_config *cfg,
+                                     uint32_t verdict)
+{
+    uint32_t dir = keymash_cb_dir(skb);
+    struct keymash_flow flow;
+    struct keymash_pkt pkt;
+
+    keymash_latency_end(dir);
+    keymash_count(dir, verdict, skb->len, keymash_segs(skb));
+    keymash_count_unit(cfg, keymash_unit(cfg, keymash_queue_skb(skb, dir)), dir, verdict,
+                       skb->len, keymash_segs(skb));
+    keymash_feedback(dir, verdict, skb->len, keymash_segs(skb));
+    keymash_ctl_update(cfg, skb->cb[KEYMASH_CB_PROFILE], verdict, skb->len, keymash_segs(skb));
+    if (keymash_sampled(cfg, skb->cb[KEYMASH_CB_INDEX])) {
+        keymash_cb_flow(skb, &flow);
+        keymash_emit(dir, verdict, skb->cb[KEYMASH_CB_THRESHOLD], skb->len, &flow,
+                     keymash_parse_skb(skb, &pkt) ? 0 : keymash_rtp_seq_skb(skb, &pkt));
+    }
+    if (verdict == KEYMASH_VERDICT_DROP) {
         return TC_ACT_SHOT; // Drop packet
     }
     return TC_ACT_OK; // Pass packet
 }
 
+static __inline__ int keymash_next(struct __sk_buff *skb, const struct keymash_config *cfg)
+{
+    uint32_t pos = skb->cb[KEYMASH_CB_POS];
+
+    skb->cb[KEYMASH_CB_POS] = pos + 1;
+    tail_call(skb, &map_keymash_pipeline, pos & ((1 << KEYMASH_CB_POS_GENERATION) - 1));
+    // only reached past the last enabled stage
+    return keymash_finish(skb, cfg, KEYMASH_VERDICT_PASS);
+}
+
+/* Lets a packet through once a stage has no config to apply. It still went
+ * through the entry program, so it is accounted for like one that made it past
+ * the last stage; the zeroed config leaves out the parts that depend on one.
+ */
+static __inline__ int keymash_stage_failed(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+
+    memset(&cfg, 0, sizeof(cfg));
+    return keymash_finish(skb, &cfg, KEYMASH_VERDICT_PASS);
+}
+
+/* Lets a packet through without impairment or accounting. */
+static __inline__ int keymash_skip(uint32_t dir)
+{
+    keymash_latency_end(dir);
+    return TC_ACT_OK;
+}
+
+static __inline__ int scream_bpf(struct __sk_buff *skb, uint32_t dir)
+{
+    struct keymash_pkt pkt;
+    struct keymash_flow flow;
+    struct keymash_config cfg;
+    uint32_t *flow_profile, profile;
+
+    if (keymash_bypassed(dir)) {
+        return TC_ACT_OK;
+    }
+    // measured up to keymash_finish, in whichever stage the packet ends up
+    keymash_latency_start(dir);
+    // traffic outside the targeted flows is never impaired
+    if (keymash_parse_skb(skb, &pkt)) {
+        return keymash_skip(dir);
+    }
+    flow_profile = keymash_flow_match(&pkt, &flow);
+    if (!flow_profile) {
+        return keymash_skip(dir);
+    }
+    profile = keymash_profile_skb(skb, flow_profile);
+    if (keymash_profile_load(&cfg, profile)) {
+        return keymash_skip(dir);
+    }
+    skb->cb[KEYMASH_CB_POS] = cfg.generation << KEYMASH_CB_POS_GENERATION;
+    skb->cb[KEYMASH_CB_FLOW] = dir << 24 | (uint32_t)flow.proto << 16 | flow.port;
+    skb->cb[KEYMASH_CB_PROFILE] = profile;
+    skb->cb[KEYMASH_CB_THRESHOLD] = 0;
+    skb->cb[KEYMASH_CB_INDEX] = keymash_index(&cfg, &flow);
+    return keymash_next(skb, &cfg);
+}
+
+/* tc can't tell a classifier which side it is attached to, so each
+ * direction gets its own section for the stats to be split by.
+ */
+__section("ingress")
+int scream_bpf_ingress(struct __sk_buff *skb)
+{
+    return scream_bpf(skb, KEYMASH_DIR_INGRESS);
+}
+
+__section("egress")
+int scream_bpf_egress(struct __sk_buff *skb)
+{
+    return scream_bpf(skb, KEYMASH_DIR_EGRESS);
+}
+
+/* Random loss with the configured model. */
+__section("stage/drop")
+int keymash_stage_drop(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+    struct keymash_pkt pkt;
+    uint32_t threshold, profile = skb->cb[KEYMASH_CB_PROFILE];
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    threshold = keymash_ctl_threshold(&cfg, profile);
+    threshold = keymash_unit_threshold(&cfg, threshold,
+                                       keymash_unit(&cfg, keymash_queue_skb(skb, keymash_cb_dir(skb))));
+    threshold = keymash_drop_threshold(&cfg, threshold, profile, skb->cb[KEYMASH_CB_INDEX]);
+    // only reparse if the classes are in use
+    if (cfg.seq_class_every && !keymash_parse_skb(skb, &pkt)) {
+        threshold = keymash_class_threshold(&cfg, threshold, &pkt, keymash_rtp_seq_skb(skb, &pkt));
+    }
+    skb->cb[KEYMASH_CB_THRESHOLD] = threshold;
+    // no draw at zero loss; draws are independent of each other, so seeded runs are unaffected
+    if (threshold && keymash_random(&cfg, skb->cb[KEYMASH_CB_INDEX], KEYMASH_DRAW_DROP) < threshold) {
+        return keymash_finish(skb, &cfg, KEYMASH_VERDICT_DROP);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* Per-flow token bucket shaping. */
+__section("stage/shape")
+int keymash_stage_shape(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+    struct keymash_flow flow;
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    keymash_cb_flow(skb, &flow);
+    if (cfg.rate_bytes_per_sec && keymash_over_rate(&cfg, &flow, skb->len)) {
+        return keymash_finish(skb, &cfg, KEYMASH_VERDICT_DROP);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* Delay and jitter; only an egress qdisc can hold packets back, so this
+ * passes ingress packets on untouched.
+ */
+__section("stage/delay")
+int keymash_stage_delay(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    if (keymash_cb_dir(skb) == KEYMASH_DIR_EGRESS) {
+        keymash_delay(skb, &cfg, skb->cb[KEYMASH_CB_INDEX]);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* Single bit flips in the UDP payload. */
+__section("stage/corrupt")
+int keymash_stage_corrupt(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+    struct keymash_pkt pkt;
+    uint32_t index = skb->cb[KEYMASH_CB_INDEX];
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    if (keymash_random(&cfg, index, KEYMASH_DRAW_CORRUPT) < cfg.corrupt_threshold &&
+        !keymash_parse_skb(skb, &pkt)) {
+        keymash_corrupt(skb, &cfg, &pkt, index);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* Truncated UDP datagrams. */
+__section("stage/truncate")
+int keymash_stage_truncate(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+    struct keymash_pkt pkt;
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    if (keymash_random(&cfg, skb->cb[KEYMASH_CB_INDEX], KEYMASH_DRAW_TRUNCATE) < cfg.truncate_threshold &&
+        !keymash_parse_skb(skb, &pkt)) {
+        keymash_truncate(skb, &cfg, &pkt);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* Reordering through departure times; like delay, egress only. */
+__section("stage/reorder")
+int keymash_stage_reorder(struct __sk_buff *skb)
+{
+    struct keymash_config cfg;
+
+    if (keymash_stage_config(skb, &cfg)) {
+        return keymash_stage_failed(skb);
+    }
+    if (keymash_cb_dir(skb) == KEYMASH_DIR_EGRESS &&
+        keymash_random(&cfg, skb->cb[KEYMASH_CB_INDEX], KEYMASH_DRAW_REORDER) < cfg.reorder_threshold) {
+        keymash_reorder(skb, &cfg);
+    }
+    return keymash_next(skb, &cfg);
+}
+
+/* XDP variant of the classifier for the ingress side. It runs in the driver
+ * before an skb is allocated, so dropped packets cost next to nothing:
+ *
+ * ip link set dev foo xdpdrv obj bpf.o sec prog
+ *
+ * ip pins into the same tc/globals directory, so this shares map_keymash
+ * (and the ingress stats) with the tc egress classifier.
+ */
+static __inline__ int scream_xdp_verdict(struct xdp_md *ctx)
+{
+    struct keymash_pkt pkt;
+    struct keymash_flow flow;
+    struct keymash_config cfg;
+    uint32_t *profile, verdict, threshold, index, unit, rtp_seq, len = ctx->data_end - ctx->data;
+
+    if (keymash_parse_data((void *)(long)ctx->data, (void *)(long)ctx->data_end, &pkt)) {
+        return XDP_PASS;
+    }
+    // there is no cgroup before an skb exists, so only the flow selects the profile
+    profile = keymash_flow_match(&pkt, &flow);
+    if (!profile) {
+        return XDP_PASS;
+    }
+    if (keymash_profile_load(&cfg, *profile)) {
+        return XDP_PASS;
+    }
+    index = keymash_index(&cfg, &flow);
+    unit = keymash_unit(&cfg, ctx->rx_queue_index);
+    rtp_seq = keymash_rtp_seq_xdp(ctx, &pkt);
+    verdict = keymash_decide(&cfg, *profile, &flow, &pkt, len, index, unit, rtp_seq, &threshold);
+    // XDP runs before GRO, so every frame is a single packet
+    keymash_count(KEYMASH_DIR_INGRESS, verdict, len, 1);
+    keymash_count_unit(&cfg, unit, KEYMASH_DIR_INGRESS, verdict, len, 1);
+    keymash_feedback(KEYMASH_DIR_INGRESS, verdict, len, 1);
+    keymash_ctl_update(&cfg, *profile, verdict, len, 1);
+    if (keymash_sampled(&cfg, index)) {
+        keymash_emit(KEYMASH_DIR_INGRESS, verdict, threshold, len, &flow, rtp_seq);
+    }
+    if (verdict == KEYMASH_VERDICT_DROP) {
+        return XDP_DROP; // Drop packet
+    }
+    return XDP_PASS; // Pass packet
+}
+
+__section_xdp_entry
+int scream_xdp(struct xdp_md *ctx)
+{
+    int action;
+
+    if (keymash_bypassed(KEYMASH_DIR_INGRESS)) {
+        return XDP_PASS;
+    }
+    keymash_latency_start(KEYMASH_DIR_INGRESS);
+    action = scream_xdp_verdict(ctx);
+    keymash_latency_end(KEYMASH_DIR_INGRESS);
+    return action;
+}
+
+/* AF_XDP sockets, one per receive queue, that surviving packets to the ports
+ * in map_keymash_xsk_ports are redirected into.
+ */
+#define KEYMASH_MAX_QUEUES	64
+
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, KEYMASH_MAX_QUEUES);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_xsks __section(".maps");
+
+struct {
+    // UDP destination ports (host byte order) that a process receives with AF_XDP
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(key_size, sizeof(uint16_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, 16);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_xsk_ports __section(".maps");
+
+/* Same verdict as scream_xdp, but the packets it lets through to a port in
+ * map_keymash_xsk_ports bypass the network stack and land in the UMEM of the
+ * AF_XDP socket bound to their queue (see xsk.rs):
+ *
+ * ip link set dev foo xdpdrv obj bpf.o sec xsk
+ *
+ * Without a socket on the queue they take the regular path, and so do IPv4
+ * fragments: the socket can't reassemble them, and the stack can't reassemble
+ * a datagram whose first fragment went to the socket.
+ */
+__section("xsk")
+int scream_xdp_xsk(struct xdp_md *ctx)
+{
+    struct keymash_pkt pkt;
+    int action;
+
+    // a bypassed packet still goes to its socket
+    if (!keymash_bypassed(KEYMASH_DIR_INGRESS)) {
+        keymash_latency_start(KEYMASH_DIR_INGRESS);
+        action = scream_xdp_verdict(ctx);
+        keymash_latency_end(KEYMASH_DIR_INGRESS);
+        if (action != XDP_PASS) {
+            return action;
+        }
+    }
+    if (keymash_parse_data((void *)(long)ctx->data, (void *)(long)ctx->data_end, &pkt) ||
+        pkt.proto != IPPROTO_UDP || pkt.first_fragment || !map_lookup_elem(&map_keymash_xsk_ports, &pkt.dport)) {
+        return XDP_PASS;
+    }
+    return redirect_map(&map_keymash_xsks, ctx->rx_queue_index, XDP_PASS);
+}
+
+#else /* KEYMASH_OFFLOAD */
+
+struct {
+    // xorshift32 state; a NIC has no notion of CPUs, and threads racing on the state only make
+    // the sequence a little less predictable
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(key_size, sizeof(uint32_t));
+    __uint(value_size, sizeof(uint32_t));
+    __uint(max_entries, 1);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} map_keymash_prng __section(".maps");
+
+static __inline__ uint32_t keymash_xorshift(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    // zero is a fixed point of xorshift, and the state of a fresh map
+    if (!x)
+        x = 0x9e3779b9;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Bernoulli loss on the NIC, counted as ingress. Shares map_keymash,
+ * map_keymash_active, map_keymash_flows and map_keymash_profiles with the
+ * regular build, so userspace drives both the same way; the maps live on the
+ * NIC, though, so the two builds can't be attached at the same time.
+ *
+ * tc filter add dev foo ingress bpf skip_sw da obj bpf-offload.o sec offload
+ */
+__section("offload")
+int scream_offload(struct __sk_buff *skb)
+{
+    struct keymash_pkt pkt;
+    struct keymash_flow flow;
+    struct keymash_config cfg;
+    uint32_t key = 0, *state, *profile, verdict = KEYMASH_VERDICT_PASS;
+
+    if (keymash_parse_data((void *)(long)skb->data, (void *)(long)skb->data_end, &pkt)) {
+        return TC_ACT_OK;
+    }
+    profile = keymash_flow_match(&pkt, &flow);
+    if (!profile) {
+        return TC_ACT_OK;
+    }
+    if (keymash_profile_load(&cfg, *profile)) {
+        return TC_ACT_OK;
+    }
+    state = map_lookup_elem(&map_keymash_prng, &key);
+    if (!state) {
+        return TC_ACT_OK;
+    }
+    if (keymash_xorshift(state) < cfg.drop_threshold) {
+        verdict = KEYMASH_VERDICT_DROP;
+    }
+    // the NIC sees wire packets
+    keymash_count(KEYMASH_DIR_INGRESS, verdict, skb->len, 1);
+    if (verdict == KEYMASH_VERDICT_DROP) {
+        return TC_ACT_SHOT; // Drop packet
+    }
+    return TC_ACT_OK; // Pass packet
+}
+
+#endif /* KEYMASH_OFFLOAD */
+
 BPF_LICENSE("GPL");
\ No newline at end of file
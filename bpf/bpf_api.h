@@ -150,6 +150,10 @@ static int BPF_FUNC(map_update_elem, void *map, const void *key,
 		    const void *value, uint32_t flags);
 static int BPF_FUNC(map_delete_elem, void *map, const void *key);
 
+/* Locking of map values (requires BTF for the map) */
+static void BPF_FUNC(spin_lock, struct bpf_spin_lock *lock);
+static void BPF_FUNC(spin_unlock, struct bpf_spin_lock *lock);
+
 /* Time access */
 static uint64_t BPF_FUNC(ktime_get_ns);
 
@@ -191,6 +195,7 @@ static uint32_t BPF_FUNC(set_hash_invalid, struct __sk_buff *skb);
 
 /* Packet redirection */
 static int BPF_FUNC(redirect, int ifindex, uint32_t flags);
+static int BPF_FUNC(redirect_map, void *map, uint32_t key, uint64_t flags);
 static int BPF_FUNC(clone_redirect, struct __sk_buff *skb, int ifindex,
 		    uint32_t flags);
 
@@ -216,6 +221,10 @@ static int BPF_FUNC(skb_change_tail, struct __sk_buff *skb, uint32_t nlen,
 
 static int BPF_FUNC(skb_pull_data, struct __sk_buff *skb, uint32_t len);
 
+/* Ring buffer */
+static void *BPF_FUNC(ringbuf_reserve, void *ringbuf, uint64_t size, uint64_t flags);
+static void BPF_FUNC(ringbuf_submit, void *data, uint64_t flags);
+
 /* Event notification */
 static int __BPF_FUNC(skb_event_output, struct __sk_buff *skb, void *map,
 		      uint64_t index, const void *data, uint32_t size) =
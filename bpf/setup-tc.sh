@@ -1,6 +1,100 @@
 #!/bin/bash
 
-sudo tc qdisc add dev wlp3s0 ingress
-sudo tc qdisc add dev wlp3s0 root handle 1: prio
-sudo tc filter add dev wlp3s0 ingress bpf da obj bpf.o sec classifier
-sudo tc filter add dev wlp3s0 protocol all parent 1: prio 1 bpf da obj bpf.o sec classifier
\ No newline at end of file
+# usage: ./setup-tc.sh [xdp|xsk [port]|edt|offload|replace]
+# (builds bpf.o from bpf.c, or bpf-offload.o for "offload", whenever it is missing or older
+# than the sources, with extra clang flags from KEYMASH_BPF_CFLAGS; "bpf-ctl attach" is an
+# alternative that needs no tc)
+# passing "xdp" attaches the ingress side as a native (driver mode) XDP program
+# instead of a tc classifier, so dropped packets never get an skb allocated.
+# passing "xsk" does the same, and redirects the video packets that survive into
+# the AF_XDP socket of recv (run it with KEYMASH_XSK_IF=wlp3s0). The NIC steers
+# the port to queue $KEYMASH_XSK_QUEUE (0 by default), the same variable recv binds
+# to; the port defaults to RECV_VIDEO_PORT in rust-userspace/src/lib.rs.
+# passing "edt" attaches both sides to a clsact qdisc and installs fq as the root
+# qdisc, so that the delay/jitter/reordering set in map_keymash is enforced on egress.
+# passing "offload" attaches the -DKEYMASH_OFFLOAD build (bpf-offload.o) to the
+# ingress side with skip_sw, so that it runs on the NIC; tc fails if the NIC can't.
+# It needs the pinned maps of a host build removed first, and vice versa.
+# passing "replace" swaps a rebuilt bpf.o into the tc filters set up by the other
+# modes, in place: no qdisc is torn down, no packet passes unfiltered, and the
+# pinned maps (config, flows, profiles, stats) are kept.
+
+cd "$(dirname "$0")" || exit 1
+
+# build <object> [clang flags]
+build() {
+    local out=$1
+    shift
+    if [ -e "$out" ] && [ "$out" -nt bpf.c ] && [ "$out" -nt bpf_api.h ] && [ "$out" -nt bpf_elf.h ]; then
+        return
+    fi
+    # Debian/Ubuntu keep <asm/types.h> in the multiarch directory, which -target bpf doesn't search
+    clang -target bpf -O2 -g -I"/usr/include/$(gcc -print-multiarch 2>/dev/null)" \
+        $KEYMASH_BPF_CFLAGS "$@" -o "$out" -c bpf.c || exit 1
+}
+
+if [ "$1" = offload ]; then
+    build bpf-offload.o -DKEYMASH_OFFLOAD
+else
+    build bpf.o
+fi
+
+case "$1" in
+xdp)
+    sudo tc qdisc add dev wlp3s0 root handle 1: prio
+    sudo ip link set dev wlp3s0 xdpdrv obj bpf.o sec prog
+    sudo tc filter add dev wlp3s0 protocol all parent 1: prio 1 handle 1 bpf da obj bpf.o sec egress
+    ;;
+xsk)
+    port=${2:-$(sed -n 's/^pub const RECV_VIDEO_PORT: u16 = \([0-9]*\);/\1/p' ../rust-userspace/src/lib.rs)}
+    if [ -z "$port" ]; then
+        echo "RECV_VIDEO_PORT not found in rust-userspace/src/lib.rs; pass the port" >&2
+        exit 1
+    fi
+    sudo tc qdisc add dev wlp3s0 root handle 1: prio
+    sudo ip link set dev wlp3s0 xdpdrv obj bpf.o sec xsk
+    # the socket only sees one queue
+    sudo ethtool -N wlp3s0 flow-type udp4 dst-port "$port" action "${KEYMASH_XSK_QUEUE:-0}"
+    sudo tc filter add dev wlp3s0 protocol all parent 1: prio 1 handle 1 bpf da obj bpf.o sec egress
+    ;;
+offload)
+    # the NIC can't take over maps pinned by a host build (map_keymash_stats isn't
+    # even the same type there), so refuse rather than have tc fail on them
+    if sudo find /sys/fs/bpf/tc/globals -maxdepth 1 -name 'map_keymash*' 2>/dev/null | grep -q .; then
+        echo "remove the pinned maps first: sudo rm /sys/fs/bpf/tc/globals/map_keymash*" >&2
+        exit 1
+    fi
+    # egress is left alone; offloading NICs only run ingress classifiers
+    sudo tc qdisc add dev wlp3s0 ingress
+    sudo tc filter add dev wlp3s0 ingress bpf skip_sw da obj bpf-offload.o sec offload
+    ;;
+edt)
+    # fq holds packets until skb->tstamp; the horizon and limits have to cover
+    # every packet that is in flight during the configured delay
+    sudo tc qdisc add dev wlp3s0 clsact
+    sudo tc qdisc add dev wlp3s0 root fq horizon 60s limit 100000 flow_limit 100000
+    sudo tc filter add dev wlp3s0 ingress prio 1 handle 1 bpf da obj bpf.o sec ingress
+    sudo tc filter add dev wlp3s0 egress prio 1 handle 1 bpf da obj bpf.o sec egress
+    ;;
+replace)
+    # replacing a filter with the same prio and handle swaps its program atomically.
+    # the stages stay the ones recv loaded into map_keymash_pipeline; restart recv
+    # (or use "bpf-ctl attach" and swap there) if they changed too
+    if sudo tc qdisc show dev wlp3s0 | grep -q clsact; then
+        sudo tc filter replace dev wlp3s0 ingress prio 1 handle 1 bpf da obj bpf.o sec ingress
+        sudo tc filter replace dev wlp3s0 egress prio 1 handle 1 bpf da obj bpf.o sec egress
+        exit
+    fi
+    if sudo tc qdisc show dev wlp3s0 ingress | grep -q ingress; then
+        sudo tc filter replace dev wlp3s0 ingress prio 1 handle 1 bpf da obj bpf.o sec ingress
+    fi
+    # and for the xdp/xsk modes: sudo ip -force link set dev wlp3s0 xdpdrv obj bpf.o sec <prog|xsk>
+    sudo tc filter replace dev wlp3s0 protocol all parent 1: prio 1 handle 1 bpf da obj bpf.o sec egress
+    ;;
+*)
+    sudo tc qdisc add dev wlp3s0 ingress
+    sudo tc qdisc add dev wlp3s0 root handle 1: prio
+    sudo tc filter add dev wlp3s0 ingress prio 1 handle 1 bpf da obj bpf.o sec ingress
+    sudo tc filter add dev wlp3s0 protocol all parent 1: prio 1 handle 1 bpf da obj bpf.o sec egress
+    ;;
+esac
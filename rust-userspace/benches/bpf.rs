@@ -0,0 +1,285 @@
+// Times the classifier's programs in the kernel with BPF_PROG_TEST_RUN, which runs a program
+// `repeat` times over the same synthetic packet and reports the mean run time. Needs the
+// embed-bpf feature (see build.rs) and root. The maps of the benchmarked objects are not pinned, so this can run next to
+// an attached filter without disturbing it.
+
+use criterion::{criterion_group, criterion_main, BenchmarkId, Criterion, Throughput};
+use libbpf_sys::{
+    bpf_object, bpf_object_open_opts, bpf_test_run_opts, BPF_ANY, BPF_MAP_TYPE_PERCPU_ARRAY,
+    BPF_PROG_TYPE_SCHED_CLS, BPF_PROG_TYPE_XDP,
+};
+use rust_userspace::bpf::{probability_to_threshold, FlowProto, KeymashConfig, KeymashFlow};
+use std::{
+    ffi::{c_int, c_void, CStr},
+    time::Duration,
+};
+
+static BPF_OBJECT: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/bpf.o"));
+static BPF_PERCPU_OBJECT: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/bpf-percpu.o"));
+
+const TARGET_PORT: u16 = 5000;
+const OTHER_PORT: u16 = 22;
+const PACKET_SIZES: [usize; 3] = [64, 512, 1500];
+// runs per packet size that the verdict distribution is taken over
+const VERDICT_RUNS: u32 = 100_000;
+
+// Keep in sync with `enum keymash_verdict` and `enum keymash_dir` in `bpf/bpf.c`.
+const KEYMASH_VERDICT_MAX: u32 = 2;
+const KEYMASH_DIR_MAX: u32 = 2;
+
+struct Variant {
+    name: &'static str,
+    object: &'static [u8],
+    program: &'static CStr,
+    // stage programs, in pipeline order
+    stages: &'static [&'static CStr],
+    config: KeymashConfig,
+    dport: u16,
+}
+
+fn variants() -> [Variant; 5] {
+    let drop = KeymashConfig::bernoulli(probability_to_threshold(0.1));
+    [
+        // traffic outside the targeted flows: parse, miss in map_keymash_flows, pass
+        Variant {
+            name: "untargeted",
+            object: BPF_OBJECT,
+            program: c"scream_bpf_ingress",
+            stages: &[c"keymash_stage_drop"],
+            config: drop,
+            dport: OTHER_PORT,
+        },
+        Variant {
+            name: "flow-filtered",
+            object: BPF_OBJECT,
+            program: c"scream_bpf_ingress",
+            stages: &[c"keymash_stage_drop"],
+            config: drop,
+            dport: TARGET_PORT,
+        },
+        Variant {
+            name: "per-cpu",
+            object: BPF_PERCPU_OBJECT,
+            program: c"scream_bpf_ingress",
+            stages: &[c"keymash_stage_drop"],
+            config: drop,
+            dport: TARGET_PORT,
+        },
+        // every stage but truncation, which would shrink the packet for the following runs
+        Variant {
+            name: "pipeline",
+            object: BPF_OBJECT,
+            program: c"scream_bpf_egress",
+            stages: &[
+                c"keymash_stage_drop",
+                c"keymash_stage_shape",
+                c"keymash_stage_delay",
+                c"keymash_stage_corrupt",
+                c"keymash_stage_reorder",
+            ],
+            config: drop
+                .with_rate_limit(1 << 30, 1 << 16)
+                .with_delay(Duration::from_millis(1), Duration::from_micros(100))
+                .with_corruption(probability_to_threshold(0.01), true)
+                .with_reorder(probability_to_threshold(0.01), Duration::from_millis(1)),
+            dport: TARGET_PORT,
+        },
+        Variant {
+            name: "xdp",
+            object: BPF_OBJECT,
+            program: c"scream_xdp",
+            stages: &[],
+            config: drop,
+            dport: TARGET_PORT,
+        },
+    ]
+}
+
+/// An Ethernet + IPv4 + UDP packet of `size` bytes in total.
+fn udp_packet(size: usize, dport: u16) -> Vec<u8> {
+    let mut packet = vec![0u8; size];
+    // destination and source MAC are left zero
+    packet[12..14].copy_from_slice(&0x0800u16.to_be_bytes());
+
+    let ip = &mut packet[14..34];
+    ip[0] = 0x45;
+    ip[2..4].copy_from_slice(&((size - 14) as u16).to_be_bytes());
+    ip[6] = 0x40; // DF
+    ip[8] = 64;
+    ip[9] = libc::IPPROTO_UDP as u8;
+    ip[12..16].copy_from_slice(&[10, 0, 0, 1]);
+    ip[16..20].copy_from_slice(&[10, 0, 0, 2]);
+    let sum = ip.chunks(2).fold(0u32, |sum, w| sum + u16::from_be_bytes([w[0], w[1]]) as u32);
+    let csum = !((sum & 0xffff) + (sum >> 16)) as u16;
+    ip[10..12].copy_from_slice(&csum.to_be_bytes());
+
+    // the checksum is left zero, i.e. unused
+    let udp = &mut packet[34..42];
+    udp[0..2].copy_from_slice(&40000u16.to_be_bytes());
+    udp[2..4].copy_from_slice(&dport.to_be_bytes());
+    udp[4..6].copy_from_slice(&((size - 34) as u16).to_be_bytes());
+    packet
+}
+
+/// A private instance of `bpf.o` loaded for one variant.
+struct TestObject {
+    obj: *mut bpf_object,
+    prog_fd: c_int,
+    nr_cpus: usize,
+}
+
+impl TestObject {
+    unsafe fn load(variant: &Variant) -> Result<Self, c_int> {
+        let mut opts: bpf_object_open_opts = std::mem::zeroed();
+        opts.sz = size_of::<bpf_object_open_opts>() as _;
+        let obj = libbpf_sys::bpf_object__open_mem(
+            variant.object.as_ptr() as *const c_void,
+            variant.object.len() as _,
+            &opts,
+        );
+        if obj.is_null() {
+            return Err(-*libc::__errno_location());
+        }
+        let mut test = TestObject {
+            obj,
+            prog_fd: -1,
+            nr_cpus: libbpf_sys::libbpf_num_possible_cpus() as usize,
+        };
+
+        // neither reuse nor replace the maps of an attached filter
+        let mut map = libbpf_sys::bpf_object__next_map(obj, std::ptr::null());
+        while !map.is_null() {
+            libbpf_sys::bpf_map__set_pin_path(map, std::ptr::null());
+            map = libbpf_sys::bpf_object__next_map(obj, map);
+        }
+        let mut prog = libbpf_sys::bpf_object__next_program(obj, std::ptr::null_mut());
+        while !prog.is_null() {
+            let name = CStr::from_ptr(libbpf_sys::bpf_program__name(prog));
+            let load = name == variant.program || variant.stages.contains(&name);
+            libbpf_sys::bpf_program__set_autoload(prog, load);
+            let prog_type = if name == c"scream_xdp" { BPF_PROG_TYPE_XDP } else { BPF_PROG_TYPE_SCHED_CLS };
+            libbpf_sys::bpf_program__set_type(prog, prog_type);
+            prog = libbpf_sys::bpf_object__next_program(obj, prog);
+        }
+        let res = libbpf_sys::bpf_object__load(obj);
+        if res != 0 {
+            return Err(res);
+        }
+        test.prog_fd = test.program_fd(variant.program);
+
+        // slot 0 with generation 0 is live in a fresh map_keymash_active
+        let per_cpu = libbpf_sys::bpf_map__type(test.map(c"map_keymash")) == BPF_MAP_TYPE_PERCPU_ARRAY;
+        let configs = vec![variant.config; if per_cpu { test.nr_cpus } else { 1 }];
+        test.update(c"map_keymash", &0u32, configs.as_ptr())?;
+        let flow = KeymashFlow::new(FlowProto::Udp, TARGET_PORT);
+        test.update(c"map_keymash_flows", &flow, &0u32)?;
+        for (pos, stage) in variant.stages.iter().enumerate() {
+            test.update(c"map_keymash_pipeline", &(pos as u32), &test.program_fd(stage))?;
+        }
+        Ok(test)
+    }
+
+    fn map(&self, name: &CStr) -> *mut libbpf_sys::bpf_map {
+        let map = unsafe { libbpf_sys::bpf_object__find_map_by_name(self.obj, name.as_ptr()) };
+        assert!(!map.is_null(), "BPF object has no map {name:?}");
+        map
+    }
+
+    fn program_fd(&self, name: &CStr) -> c_int {
+        let prog = unsafe { libbpf_sys::bpf_object__find_program_by_name(self.obj, name.as_ptr()) };
+        assert!(!prog.is_null(), "BPF object has no program {name:?}");
+        unsafe { libbpf_sys::bpf_program__fd(prog) }
+    }
+
+    unsafe fn update<K, V>(&self, name: &CStr, key: *const K, value: *const V) -> Result<(), c_int> {
+        let fd = libbpf_sys::bpf_map__fd(self.map(name));
+        let res = libbpf_sys::bpf_map_update_elem(fd, key as *const c_void, value as *const c_void, BPF_ANY.into());
+        if res != 0 {
+            return Err(res);
+        }
+        Ok(())
+    }
+
+    /// Runs the program `repeat` times on `packet` and returns the mean run time.
+    fn test_run(&self, packet: &[u8], repeat: u32) -> Duration {
+        let mut opts: bpf_test_run_opts = unsafe { std::mem::zeroed() };
+        opts.sz = size_of::<bpf_test_run_opts>() as _;
+        opts.data_in = packet.as_ptr() as *const c_void;
+        opts.data_size_in = packet.len() as _;
+        opts.repeat = repeat as _;
+        let res = unsafe { libbpf_sys::bpf_prog_test_run_opts(self.prog_fd, &mut opts) };
+        assert_eq!(res, 0, "BPF_PROG_TEST_RUN failed");
+        Duration::from_nanos(opts.duration as u64)
+    }
+
+    /// Passed and dropped packets so far, summed over directions and CPUs.
+    fn verdicts(&self) -> [u64; KEYMASH_VERDICT_MAX as usize] {
+        let fd = unsafe { libbpf_sys::bpf_map__fd(self.map(c"map_keymash_stats")) };
+        let mut verdicts = [0; KEYMASH_VERDICT_MAX as usize];
+        // struct keymash_stats is { packets, bytes, segments } for every CPU
+        let mut values = vec![[0u64; 3]; self.nr_cpus];
+        for key in 0..KEYMASH_DIR_MAX * KEYMASH_VERDICT_MAX {
+            let res = unsafe {
+                libbpf_sys::bpf_map_lookup_elem(fd, &key as *const u32 as *const c_void, values.as_mut_ptr() as *mut c_void)
+            };
+            assert_eq!(res, 0, "failed to read map_keymash_stats");
+            verdicts[(key % KEYMASH_VERDICT_MAX) as usize] += values.iter().map(|v| v[0]).sum::<u64>();
+        }
+        verdicts
+    }
+}
+
+impl Drop for TestObject {
+    fn drop(&mut self) {
+        unsafe { libbpf_sys::bpf_object__close(self.obj) };
+    }
+}
+
+fn bench_classifier(c: &mut Criterion) {
+    for variant in variants() {
+        let test = match unsafe { TestObject::load(&variant) } {
+            Ok(test) => test,
+            Err(err) => {
+                eprintln!("skipping {}: could not load bpf.o ({err}); are we root?", variant.name);
+                continue;
+            }
+        };
+
+        let mut group = c.benchmark_group(format!("bpf/{}", variant.name));
+        group.throughput(Throughput::Elements(1));
+        for size in PACKET_SIZES {
+            let packet = udp_packet(size, variant.dport);
+
+            let before = test.verdicts();
+            test.test_run(&packet, VERDICT_RUNS);
+            let after = test.verdicts();
+            let (passed, dropped) = (after[0] - before[0], after[1] - before[1]);
+            let percent = |n: u64| n as f64 * 100.0 / VERDICT_RUNS as f64;
+            println!(
+                "bpf/{}/{size}: {:.2}% passed, {:.2}% dropped, {:.2}% not targeted",
+                variant.name,
+                percent(passed),
+                percent(dropped),
+                percent(VERDICT_RUNS as u64 - passed - dropped),
+            );
+
+            group.bench_with_input(BenchmarkId::from_parameter(size), &packet, |b, packet| {
+                b.iter_custom(|iters| {
+                    let mut total = Duration::ZERO;
+                    let mut left = iters;
+                    while left > 0 {
+                        // repeat is an int
+                        let repeat = left.min(i32::MAX as u64) as u32;
+                        total += test.test_run(packet, repeat) * repeat;
+                        left -= repeat as u64;
+                    }
+                    total
+                });
+            });
+        }
+        group.finish();
+    }
+}
+
+criterion_group!(benches, bench_classifier);
+criterion_main!(benches);
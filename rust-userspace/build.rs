@@ -0,0 +1,52 @@
+// Compiles bpf/bpf.c so that `bpf::attach` can load it without a checked-in object.
+// Extra clang flags (e.g. -DKEYMASH_PERCPU_MAP) can be passed in KEYMASH_BPF_CFLAGS.
+// The benchmarks also get a per-CPU build, bpf-percpu.o.
+//
+// Only with the opt-in `embed-bpf` feature, which then needs clang; without it bpf::attach
+// returns an error instead.
+
+use std::{env, path::PathBuf, process::Command};
+
+fn main() {
+    if env::var_os("CARGO_FEATURE_EMBED_BPF").is_none() {
+        return;
+    }
+    let src = PathBuf::from("../bpf/bpf.c");
+    let out_dir = PathBuf::from(env::var("OUT_DIR").unwrap());
+    println!("cargo:rerun-if-changed=../bpf/bpf.c");
+    println!("cargo:rerun-if-changed=../bpf/bpf_api.h");
+    println!("cargo:rerun-if-changed=../bpf/bpf_elf.h");
+    println!("cargo:rerun-if-env-changed=KEYMASH_BPF_CFLAGS");
+
+    let cflags = env::var("KEYMASH_BPF_CFLAGS").unwrap_or_default();
+    // -target bpf doesn't search the multiarch directory that holds <asm/types.h> on Debian
+    let multiarch = Command::new("gcc")
+        .arg("-print-multiarch")
+        .output()
+        .ok()
+        .and_then(|out| String::from_utf8(out.stdout).ok())
+        .filter(|triple| !triple.trim().is_empty())
+        .map(|triple| PathBuf::from("/usr/include").join(triple.trim()))
+        .filter(|dir| dir.is_dir());
+    for (name, variant_flags) in [("bpf.o", ""), ("bpf-percpu.o", "-DKEYMASH_PERCPU_MAP")] {
+        let out = out_dir.join(name);
+        let status = Command::new("clang")
+            .args(["-target", "bpf", "-O2", "-g"])
+            .args(multiarch.iter().map(|dir| format!("-I{}", dir.display())))
+            .args(cflags.split_whitespace())
+            .args(variant_flags.split_whitespace())
+            .arg("-o")
+            .arg(&out)
+            .arg("-c")
+            .arg(&src)
+            .status();
+
+        match status {
+            Ok(status) if status.success() => {}
+            Ok(status) => panic!("clang failed to compile {} into {name} ({status})", src.display()),
+            Err(err) => panic!(
+                "could not run clang ({err}); install it, or build without the embed-bpf feature"
+            ),
+        }
+    }
+}
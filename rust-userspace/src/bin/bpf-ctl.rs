@@ -0,0 +1,190 @@
+// ----------------------------------------------------------------------------
+// Inspects the eBPF filter from the command line. Needs the maps that
+// bpf/setup-tc.sh pins; run as root.
+//
+// usage: bpf-ctl stats      packet counters of the targeted flows, and of bypassed packets
+//        bpf-ctl latency    per-packet run time of the filter (-DKEYMASH_INSTRUMENT build)
+//        bpf-ctl units      packet counters per queue, CPU or NUMA node (see KeymashConfig::with_scope)
+//        bpf-ctl unit <unit> <loss %|off>
+//                           give one queue, CPU or NUMA node its own loss rate
+//        bpf-ctl replay <trace>
+//                           play a recorded loss/delay/rate trace in the filter (see bpf::read_trace)
+//        bpf-ctl attach <interface> [ingress] [egress]
+//                           attach the filter instead of setup-tc.sh, until enter is pressed
+//                           (needs the embed-bpf feature);
+//                           entering the path of another bpf.o swaps it in without detaching
+// ----------------------------------------------------------------------------
+
+use rust_userspace::bpf;
+
+fn print_stats(handle: &bpf::BpfHandle) -> Result<(), bpf::BpfError> {
+    print_directions("", &handle.read_stats()?);
+    // the offload build has no bypass
+    if let Ok([ingress, egress]) = handle.read_bypassed() {
+        println!("bypassed ingress {ingress:>10} pkts  egress {egress:>10} pkts");
+    }
+    Ok(())
+}
+
+fn print_directions(prefix: &str, stats: &bpf::KeymashStats) {
+    for (name, dir) in [("ingress", stats.ingress), ("egress", stats.egress)] {
+        println!(
+            "{prefix}{name:8} passed {:>10} pkts {:>10} segs {:>14} bytes  dropped {:>10} pkts {:>10} segs {:>14} bytes  ({:.2}% loss)",
+            dir.passed_packets,
+            dir.passed_segments,
+            dir.passed_bytes,
+            dir.dropped_packets,
+            dir.dropped_segments,
+            dir.dropped_bytes,
+            dir.drop_rate() * 100.0,
+        );
+    }
+}
+
+fn print_unit_stats(handle: &bpf::BpfHandle) -> Result<(), bpf::BpfError> {
+    for (unit, stats) in handle.read_unit_stats()? {
+        print_directions(&format!("{unit:>4} "), &stats);
+    }
+    Ok(())
+}
+
+fn set_unit(handle: &bpf::BpfHandle, args: &[String]) -> Result<(), bpf::BpfError> {
+    let parsed = match args {
+        [unit, loss] => unit.parse::<u32>().ok().zip(match loss.as_str() {
+            "off" => Some(None),
+            loss => loss.parse::<f64>().ok().map(|p| Some(bpf::probability_to_threshold(p / 100.0))),
+        }),
+        _ => None,
+    };
+    let Some((unit, threshold)) = parsed else {
+        eprintln!("usage: bpf-ctl unit <unit> <loss %|off>");
+        std::process::exit(2);
+    };
+    handle.set_unit_threshold(unit, threshold)
+}
+
+fn print_latency(handle: &bpf::BpfHandle) -> Result<(), bpf::BpfError> {
+    let histogram = handle.read_latency()?;
+    for (name, buckets) in [("ingress", &histogram.ingress), ("egress", &histogram.egress)] {
+        let total: u64 = buckets.iter().sum();
+        println!("{name}: {total} packets");
+        if total == 0 {
+            continue;
+        }
+        for (q, label) in [(0.5, "p50"), (0.99, "p99"), (0.999, "p99.9")] {
+            println!("  {label:6} < {} ns", bpf::latency_quantile(buckets, q).unwrap());
+        }
+        // only the range that has packets, like bpftrace's hist()
+        let first = buckets.iter().position(|&c| c != 0).unwrap();
+        let last = buckets.iter().rposition(|&c| c != 0).unwrap();
+        let max = *buckets.iter().max().unwrap();
+        for i in first..=last {
+            let bar = "@".repeat((buckets[i] * 40).div_ceil(max) as usize);
+            println!("  [{:>10}, {:>10}) {:>12} |{bar:40}|", 1u64 << i, 1u64 << (i + 1), buckets[i]);
+        }
+    }
+    Ok(())
+}
+
+fn replay(args: &[String]) -> Result<(), bpf::BpfError> {
+    let [path] = args else {
+        eprintln!("usage: bpf-ctl replay <trace>");
+        std::process::exit(2);
+    };
+    let file = match std::fs::File::open(path) {
+        Ok(file) => file,
+        Err(e) => {
+            eprintln!("{path}: {e}");
+            std::process::exit(1);
+        }
+    };
+    // check the whole trace first, rather than replay it cut short at a malformed line
+    let steps = match bpf::read_trace(std::io::BufReader::new(file)).collect::<Result<Vec<_>, _>>() {
+        Ok(steps) => steps,
+        Err(e) => {
+            eprintln!("{path}: {e}");
+            std::process::exit(1);
+        }
+    };
+    let res = unsafe { bpf::play_schedule(steps) };
+    // otherwise the last step stays in effect
+    unsafe { bpf::stop_schedule()? };
+    res
+}
+
+/// Attaches with tcx links, which go away with this process.
+fn attach(args: &[String]) -> Result<(), bpf::BpfError> {
+    let Some((ifname, directions)) = args.split_first() else {
+        eprintln!("usage: bpf-ctl attach <interface> [ingress] [egress]");
+        std::process::exit(2);
+    };
+    let mut dirs = Vec::new();
+    for dir in directions {
+        match dir.as_str() {
+            "ingress" => dirs.push(bpf::Direction::Ingress),
+            "egress" => dirs.push(bpf::Direction::Egress),
+            _ => {
+                eprintln!("unknown direction {dir}");
+                std::process::exit(2);
+            }
+        }
+    }
+    if dirs.is_empty() {
+        dirs = vec![bpf::Direction::Ingress, bpf::Direction::Egress];
+    }
+
+    let mut attachment = unsafe { bpf::attach(ifname, &dirs)? };
+    attachment.pipeline().set_stages(&[bpf::Stage::Drop])?;
+    println!("attached to {ifname} {dirs:?}; enter a bpf.o to swap to, or nothing to detach");
+    let mut line = String::new();
+    while std::io::stdin().read_line(&mut line).is_ok_and(|n| n > 0) && !line.trim().is_empty() {
+        let Ok(path) = std::ffi::CString::new(line.trim()) else {
+            eprintln!("invalid path");
+            line.clear();
+            continue;
+        };
+        // a failed swap leaves the old filter attached
+        match unsafe { attachment.replace(Some(&path), &[bpf::Stage::Drop]) } {
+            Ok(()) => println!("swapped to {path:?}"),
+            Err(e) => eprintln!("failed to swap to {path:?}: {e:?}"),
+        }
+        line.clear();
+    }
+    Ok(())
+}
+
+fn main() {
+    let args: Vec<String> = std::env::args().skip(1).collect();
+    let command = args.first().cloned();
+    if command.as_deref() == Some("attach") {
+        if let Err(e) = attach(&args[1..]) {
+            eprintln!("{e:?}");
+            std::process::exit(1);
+        }
+        return;
+    }
+
+    let handle = match unsafe { bpf::init() } {
+        Ok(handle) => handle,
+        Err(e) => {
+            eprintln!("failed to open the BPF maps (is the filter attached?): {e:?}");
+            std::process::exit(1);
+        }
+    };
+
+    let res = match command.as_deref() {
+        Some("stats") => print_stats(&handle),
+        Some("latency") => print_latency(&handle),
+        Some("units") => print_unit_stats(&handle),
+        Some("unit") => set_unit(&handle, &args[1..]),
+        Some("replay") => replay(&args[1..]),
+        _ => {
+            eprintln!("usage: bpf-ctl <stats|latency|units|unit|replay|attach>");
+            std::process::exit(2);
+        }
+    };
+    if let Err(e) = res {
+        eprintln!("{e:?}");
+        std::process::exit(1);
+    }
+}
@@ -12,7 +12,11 @@ use bytes::Buf;
 use sdl2::{self, pixels::{Color, PixelFormatEnum}, rect::Rect};
 use video::{decode_quantized_macroblock, dequantize_macroblock, MutableYUVFrame};
 use zerocopy::{FromBytes, Immutable, IntoBytes, KnownLayout};
-use std::{net::Ipv4Addr, time::Duration};
+use std::{
+    net::Ipv4Addr,
+    sync::{atomic::Ordering, Arc},
+    time::Duration,
+};
 
 #[derive(FromBytes, Debug, IntoBytes, Immutable, KnownLayout)]
 #[repr(C)]
@@ -28,9 +32,32 @@ fn main() -> std::io::Result<()> {
         log::info!("Starting BPF thread");
         let bpf_handle = unsafe { bpf::init().unwrap() };
         log::info!("BPF map found and opened");
+        // only impair the video stream; leave the control channel alone
+        bpf_handle.add_target_flow(bpf::FlowProto::Udp, RECV_VIDEO_PORT).unwrap();
+        bpf_handle.write_to_map(&bpf::KeymashConfig::default()).unwrap();
+        // random loss is the only impairment the exhibit uses
+        // until the pipeline is filled, the filter passes the video unimpaired
+        let obj_path = bpf::bpf_object_path();
+        let pipeline = match unsafe { bpf::load_pipeline(&obj_path) } {
+            Ok(pipeline) => pipeline,
+            Err(err) => {
+                eprintln!("Failed to load the BPF stages from {obj_path:?} ({err:?}); see recv.log");
+                log::logger().flush();
+                std::process::exit(1);
+            }
+        };
+        pipeline.set_stages(&[bpf::Stage::Drop]).unwrap();
+        // the drop rate changes every frame, so set it through the mmapped map instead of a syscall;
+        // no loss until the first frame asks for some, like the published config
+        let threshold_writer = unsafe { bpf::open_threshold_writer(0).unwrap() };
         loop {
             match bpf_receive_channel.recv() {
-                Ok(val) => bpf_handle.write_to_map(0, val).unwrap(),
+                Ok(val) => {
+                    threshold_writer.set_threshold(val);
+                    // nothing to drop at zero loss, so pass packets unparsed; only the bypass
+                    // counter keeps going meanwhile
+                    threshold_writer.set_bypass(val == 0);
+                }
                 Err(_) => break,
             }
         }
@@ -69,9 +96,33 @@ fn main() -> std::io::Result<()> {
     let texture_creator = renderer.texture_creator();
     let mut texture = texture_creator.create_texture_streaming(PixelFormatEnum::YUY2, VIDEO_WIDTH, VIDEO_HEIGHT).unwrap();
 
-    let video_recieving_socket = udp_connect_retry((Ipv4Addr::UNSPECIFIED, RECV_VIDEO_PORT));
-    video_recieving_socket.connect((SEND_IP, SEND_VIDEO_PORT)).unwrap();
-    let video_receiver = rtp::RtpSlicePayloadReceiver::<u8, PACKET_PAYLOAD_SIZE_THRESHOLD, 8192>::new(video_recieving_socket);
+    // KEYMASH_XSK_IF=<interface> receives the video stream with AF_XDP from queue KEYMASH_XSK_QUEUE
+    // (default 0), which needs bpf.o's "xsk" XDP program on the interface; see rust_userspace::xsk
+    let video_receiver = match std::env::var("KEYMASH_XSK_IF") {
+        Ok(ifname) => {
+            let queue = match std::env::var("KEYMASH_XSK_QUEUE") {
+                Ok(queue) => queue.parse().unwrap_or_else(|_| {
+                    eprintln!("KEYMASH_XSK_QUEUE={queue:?} is not a queue number");
+                    std::process::exit(2);
+                }),
+                Err(_) => 0,
+            };
+            let xsk = unsafe { xsk::XskSocket::bind(&ifname, queue, RECV_VIDEO_PORT).unwrap() };
+            rtp::RtpSlicePayloadReceiver::<u8, PACKET_PAYLOAD_SIZE_THRESHOLD, 8192>::new_xsk(xsk)
+        }
+        Err(_) => {
+            let video_recieving_socket = udp_connect_retry((Ipv4Addr::UNSPECIFIED, RECV_VIDEO_PORT));
+            video_recieving_socket.connect((SEND_IP, SEND_VIDEO_PORT)).unwrap();
+            rtp::RtpSlicePayloadReceiver::<u8, PACKET_PAYLOAD_SIZE_THRESHOLD, 8192>::new(video_recieving_socket)
+        }
+    };
+
+    // KEYMASH_METRICS_ADDR=<addr>:<port> serves the filter's and the receiver's counters to
+    // Prometheus; see rust_userspace::telemetry
+    let playout_stats = Arc::new(telemetry::PlayoutStats::default());
+    if let Ok(addr) = std::env::var("KEYMASH_METRICS_ADDR") {
+        telemetry::spawn_exporter(addr, video_receiver.stats(), playout_stats.clone()).unwrap();
+    }
 
     let sender_communication_socket = udp_connect_retry((Ipv4Addr::UNSPECIFIED, RECV_CONTROL_PORT));
     sender_communication_socket.connect((SEND_IP, SEND_CONTROL_PORT)).unwrap();
@@ -107,6 +158,8 @@ fn main() -> std::io::Result<()> {
 
         let bpf_drop_rate = wpm::wpm_to_drop_amt(wpm);
         log::info!("BPF drop rate: {} ({})", bpf_drop_rate, (bpf_drop_rate as f64 / u32::MAX as f64) * 100.0);
+        playout_stats.set_wpm(wpm);
+        playout_stats.drop_threshold.store(bpf_drop_rate, Ordering::Relaxed);
 
         match bpf_write_channel.send(bpf_drop_rate) {
             Ok(_) => {},
@@ -134,6 +187,7 @@ fn main() -> std::io::Result<()> {
             // Handles the case: sender is falling behind in sending packets.
             if locked_video_receiver.early_latest_span() < 20 {
                 log::info!("Sleeping and waiting for more packets to arrive. Early-latest span {}", locked_video_receiver.early_latest_span());
+                playout_stats.stalls.fetch_add(1, Ordering::Relaxed);
                 return;
             }
 
@@ -156,6 +210,7 @@ fn main() -> std::io::Result<()> {
                     let packet_frame_count = cursor.get_u32();
                     if packet_frame_count > frame_count {
                         log::warn!("Skipping ahead to frame {}", packet_frame_count);
+                        playout_stats.skipped.fetch_add((packet_frame_count - frame_count) as u64, Ordering::Relaxed);
                         frame_count = packet_frame_count;
                         packet_index = 0;
                     }
@@ -194,6 +249,7 @@ fn main() -> std::io::Result<()> {
             }
 
             frame_count += 1;
+            playout_stats.frames.fetch_add(1, Ordering::Relaxed);
         }).unwrap();
 
         renderer.copy(&texture, None, dest_rect).unwrap();
@@ -203,6 +259,7 @@ fn main() -> std::io::Result<()> {
         log::info!("Recieved and drew frame {} in {} ms", frame_count, elapsed.as_millis());
         // delay to hit target FPS
         let target_latency = Duration::from_secs_f64(1.0 / VIDEO_FPS_TARGET);
+        playout_stats.record_pass(elapsed, target_latency);
         if elapsed < target_latency {
             std::thread::sleep(target_latency - elapsed);
         } else {
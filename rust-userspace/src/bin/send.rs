@@ -156,8 +156,24 @@ pub fn send_video() {
     });
 
     let mut sender: RtpSlicePayloadSender<u8, PACKET_PAYLOAD_SIZE_THRESHOLD> = rtp::RtpSender::new(sock);
+    // e.g. KEYMASH_GSO_SEGMENTS=16 to hand the kernel up to 16 packets per send
+    if let Ok(segments) = std::env::var("KEYMASH_GSO_SEGMENTS") {
+        sender = sender.with_gso(segments.parse().unwrap_or_else(|_| {
+            eprintln!("KEYMASH_GSO_SEGMENTS={segments:?} is not a number of segments");
+            std::process::exit(2);
+        }));
+    }
     let sender = Arc::new(Mutex::new(&mut sender));
 
+    // if this host impairs the stream itself, react to its loss without waiting for the receiver
+    let mut feedback = match unsafe { bpf::open_feedback(bpf::Direction::Egress) } {
+        Ok(feedback) => Some(feedback),
+        Err(e) => {
+            log::info!("No local loss feedback ({e:?}); relying on receiver reports only");
+            None
+        }
+    };
+
     let mut frame_delay_buffer = FrameCircularBuffer::new();
     let mut frame_count = 0;
 
@@ -186,6 +202,13 @@ pub fn send_video() {
 
         let frame = YUVFrame::new(VIDEO_WIDTH as usize, VIDEO_HEIGHT as usize, frame);
 
+        // coarser quantization under loss, so that the bytes that get through carry the frame.
+        // quality multiplies the quantization tables (video::quality_scaled_q_matrix), so a
+        // larger value is coarser; the cap below is the coarsest quality the receiver asks for.
+        // The quality goes out with each macroblock, so the receiver dequantizes it correctly.
+        let loss = feedback.as_mut().map_or(0.0, |feedback| feedback.poll().loss);
+        let loss_scale = 1.0 / (1.0 - loss).max(0.1);
+
         fn process_block(
             quality: Arc<RwLock<f64>>,
             frame: &YUVFrame<'_>,
@@ -196,6 +219,7 @@ pub fn send_video() {
             y_end: usize,
             sender: Arc<Mutex<&mut RtpSlicePayloadSender<u8, PACKET_PAYLOAD_SIZE_THRESHOLD>>>,
             packet_buf: Arc<Mutex<Vec<u8>>>,
+            loss_scale: f64,
         ) {
             let mut current_macroblock_buf = Vec::with_capacity(PACKET_PAYLOAD_SIZE_THRESHOLD);
 
@@ -206,7 +230,7 @@ pub fn send_video() {
 
                 // get quality
                 // cycle quality between 0.3 and 0.03 based on the current time
-                let quality = quality.read().unwrap().clone();
+                let quality = (quality.read().unwrap().clone() * loss_scale).min(wpm::WORST_JPEG_QUALITY);
 
                 let quantized_macroblock = quantize_macroblock(&block, quality);
 
@@ -269,6 +293,7 @@ pub fn send_video() {
                             y as usize + PAR_PACKET_SPAN,
                             sender.clone(),
                             packet_buf.clone(),
+                            loss_scale,
                         );
                     });
             });
@@ -284,9 +309,10 @@ pub fn send_video() {
                 packet_buf.len()
             });
         }
+        sender.lock().unwrap().flush();
 
         let elapsed = start_time.elapsed();
-        log::info!("Sent frame {} in seq {}-{} in {} ms", frame_count, start_seq, sender.lock().unwrap().seq_num(), elapsed.as_millis());
+        log::info!("Sent frame {} in seq {}-{} in {} ms ({:.1}% local loss)", frame_count, start_seq, sender.lock().unwrap().seq_num(), elapsed.as_millis(), loss * 100.0);
 
         // delay to hit target FPS
         let target_latency = Duration::from_secs_f64(1.0 / VIDEO_FPS_TARGET);
@@ -1,56 +1,1997 @@
 use std::{
-    ffi::CStr,
+    collections::VecDeque,
+    ffi::{CStr, CString},
+    io::{self, BufRead},
     os::raw::{c_int, c_void},
+    sync::atomic::{AtomicU32, AtomicU64, AtomicUsize, Ordering},
+    time::{Duration, Instant},
 };
 
-use libbpf_sys::{bpf_obj_get, BPF_ANY};
+use libbpf_sys::{
+    bpf_link, bpf_map_get_info_by_fd, bpf_map_info, bpf_obj_get, bpf_object, bpf_object_open_opts,
+    bpf_program, libbpf_num_possible_cpus, BPF_ANY, BPF_MAP_TYPE_PERCPU_ARRAY,
+    BPF_PROG_TYPE_SCHED_CLS, BPF_TCX_EGRESS, BPF_TCX_INGRESS,
+};
+
+/// The object `bpf/setup-tc.sh` attaches, as found from this crate's sources.
+const BPF_OBJECT_DEFAULT_PATH: &str = concat!(env!("CARGO_MANIFEST_DIR"), "/../bpf/bpf.o");
+
+/// The object to load the stage pipeline from: `$KEYMASH_BPF_OBJECT` if set, else `bpf/bpf.o` of
+/// the checkout this crate was built from, whatever the working directory. It has to be the
+/// object tc attached; see [`load_pipeline`].
+pub fn bpf_object_path() -> CString {
+    let path = std::env::var("KEYMASH_BPF_OBJECT").unwrap_or_else(|_| BPF_OBJECT_DEFAULT_PATH.to_string());
+    CString::new(path).expect("KEYMASH_BPF_OBJECT contains a NUL byte")
+}
+
+/// Where tc pins the maps; the stage programs reuse them from here.
+const BPF_PIN_ROOT: &CStr = c"/sys/fs/bpf/tc/globals";
+/// `bpf/bpf.c` as compiled by `build.rs`; empty without the `embed-bpf` feature.
+#[cfg(feature = "embed-bpf")]
+static BPF_OBJECT: &[u8] = include_bytes!(concat!(env!("OUT_DIR"), "/bpf.o"));
+#[cfg(not(feature = "embed-bpf"))]
+static BPF_OBJECT: &[u8] = &[];
 
 const BPF_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash";
+const BPF_ACTIVE_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_active";
+const BPF_FAST_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_fast";
+const BPF_BYPASSED_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_bypassed";
+const BPF_FLOWS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_flows";
+const BPF_PROFILES_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_profiles";
+const BPF_SEQ_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_seq";
+const BPF_GE_STATE_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_ge_state";
+const BPF_CTL_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_ctl";
+const BPF_LATENCY_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_latency";
+const BPF_STATS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_stats";
+const BPF_UNITS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_units";
+const BPF_UNIT_STATS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_unit_stats";
+const BPF_FEEDBACK_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_feedback";
+const BPF_SCHEDULE_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_schedule";
+const BPF_SCHEDULE_STATE_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_schedule_state";
+const BPF_EVENTS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_events";
+const BPF_PIPELINE_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_pipeline";
+const BPF_XSKS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_xsks";
+const BPF_XSK_PORTS_MAP_NAME: &CStr = c"/sys/fs/bpf/tc/globals/map_keymash_xsk_ports";
+
+/// L4 protocols that flows can be targeted by. See [`BpfHandle::add_target_flow`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+#[repr(u8)]
+pub enum FlowProto {
+    Tcp = libc::IPPROTO_TCP as u8,
+    Udp = libc::IPPROTO_UDP as u8,
+}
+
+/// Mirrors `struct keymash_flow` in `bpf/bpf.c`, the key of `map_keymash_flows`.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct KeymashFlow {
+    proto: u8,
+    pad: u8,
+    /// host byte order
+    port: u16,
+}
+
+impl KeymashFlow {
+    pub fn new(proto: FlowProto, port: u16) -> Self {
+        KeymashFlow { proto: proto as u8, pad: 0, port }
+    }
+}
+
+/// Scales a probability in `[0, 1]` to the `u32` threshold used by the filter.
+pub fn probability_to_threshold(p: f64) -> u32 {
+    (p.clamp(0.0, 1.0) * u32::MAX as f64) as u32
+}
+
+/// How the filter decides which packets to drop. Mirrors `enum keymash_model` in `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+pub enum DropModel {
+    /// Every packet is dropped independently with probability `drop_threshold`.
+    #[default]
+    Bernoulli = 0,
+    /// A two-state Markov chain that produces bursts of loss.
+    GilbertElliott = 1,
+}
+
+/// Impairment parameters of the filter. Mirrors `struct keymash_config` in `bpf/bpf.c`.
+///
+/// All probabilities are `u32` thresholds; see [`probability_to_threshold`].
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+pub struct KeymashConfig {
+    /// Filled in by [`BpfHandle::write_to_map`] when publishing, like `generation_end`.
+    generation: u32,
+    /// See [`KeymashConfig::with_seed`].
+    seeded: u32,
+    /// Drop probability (of the good state, for [`DropModel::GilbertElliott`]).
+    pub drop_threshold: u32,
+    pub model: DropModel,
+    /// Per-packet probability of moving from the good to the bad state.
+    pub ge_enter_bad: u32,
+    /// Per-packet probability of moving from the bad to the good state.
+    pub ge_exit_bad: u32,
+    /// Drop probability in the bad state.
+    pub ge_bad_drop: u32,
+    /// Token bucket depth in bytes. See [`KeymashConfig::with_rate_limit`].
+    pub burst_bytes: u32,
+    /// Token bucket refill rate per targeted flow, or 0 to disable shaping.
+    pub rate_bytes_per_sec: u64,
+    /// Egress delay. See [`KeymashConfig::with_delay`].
+    pub delay_ns: u64,
+    /// Upper bound of the uniform random delay added on top of `delay_ns`.
+    pub jitter_ns: u32,
+    /// Report 1 in `event_sample_every` targeted packets to the event stream, or 0 to disable.
+    /// See [`open_event_stream`].
+    pub event_sample_every: u32,
+    /// See [`KeymashConfig::with_seq_class`].
+    pub seq_class_every: u32,
+    pub seq_class_threshold: u32,
+    /// See [`KeymashConfig::with_corruption`].
+    pub corrupt_threshold: u32,
+    pub corrupt_fix_csum: u32,
+    /// See [`KeymashConfig::with_truncation`].
+    pub truncate_threshold: u32,
+    pub truncate_len: u32,
+    /// See [`KeymashConfig::with_reorder`].
+    pub reorder_threshold: u32,
+    pub reorder_ns: u32,
+    seed: u64,
+    /// See [`KeymashConfig::with_target_loss`] and [`KeymashConfig::with_target_rate`].
+    ctl_mode: ControlMode,
+    ctl_interval_ns: u32,
+    ctl_target_rate: u64,
+    /// See [`KeymashConfig::with_scope`].
+    scope: Scope,
+    generation_end: u32,
+}
+
+// `sizeof(struct keymash_config)`, which the map's value size is checked against in `init`
+const KEYMASH_CONFIG_SIZE: usize = 120;
+const _: () = assert!(size_of::<KeymashConfig>() == KEYMASH_CONFIG_SIZE);
+const _: () = assert!(std::mem::offset_of!(KeymashConfig, generation_end) == KEYMASH_CONFIG_SIZE - 4);
+
+/// Mirrors `enum keymash_ctl_mode` in `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+enum ControlMode {
+    #[default]
+    Off = 0,
+    Loss = 1,
+    Rate = 2,
+}
+
+/// What a unit of [`BpfHandle::set_unit_threshold`] and [`BpfHandle::read_unit_stats`] is.
+/// Mirrors `enum keymash_scope` in `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[repr(u32)]
+pub enum Scope {
+    /// No units; the whole host shares one drop threshold.
+    #[default]
+    Host = 0,
+    /// The RX queue a packet arrived on, or the TX queue it leaves through on egress.
+    Queue = 1,
+    /// The CPU the filter runs on for the packet.
+    Cpu = 2,
+    /// The NUMA node of that CPU.
+    Node = 3,
+}
+
+impl KeymashConfig {
+    /// Drop every packet independently with the given threshold.
+    pub fn bernoulli(drop_threshold: u32) -> Self {
+        Self {
+            drop_threshold,
+            ..Default::default()
+        }
+    }
+
+    /// Gilbert-Elliott burst loss with explicit transition and loss probabilities.
+    pub fn gilbert_elliott(good_drop: u32, bad_drop: u32, enter_bad: u32, exit_bad: u32) -> Self {
+        Self {
+            drop_threshold: good_drop,
+            model: DropModel::GilbertElliott,
+            ge_enter_bad: enter_bad,
+            ge_exit_bad: exit_bad,
+            ge_bad_drop: bad_drop,
+            ..Default::default()
+        }
+    }
+
+    /// Gilbert model (no loss in the good state, all packets lost in the bad state) with the given
+    /// long-run loss rate and mean burst length in packets.
+    pub fn bursty(loss_rate: f64, mean_burst_len: f64) -> Self {
+        let loss_rate = loss_rate.clamp(0.0, 0.999);
+        let exit_bad = 1.0 / mean_burst_len.max(1.0);
+        // stationary loss is enter / (enter + exit)
+        let enter_bad = loss_rate * exit_bad / (1.0 - loss_rate);
+        Self::gilbert_elliott(
+            0,
+            u32::MAX,
+            probability_to_threshold(enter_bad),
+            probability_to_threshold(exit_bad),
+        )
+    }
+
+    /// Additionally pace each targeted flow to `rate_bytes_per_sec`, allowing bursts of up to
+    /// `burst_bytes`. Packets that survive the drop model but exceed the budget are dropped.
+    /// `burst_bytes` should be at least one full packet, or nothing gets through.
+    pub fn with_rate_limit(self, rate_bytes_per_sec: u64, burst_bytes: u32) -> Self {
+        Self {
+            rate_bytes_per_sec,
+            burst_bytes,
+            ..self
+        }
+    }
+
+    /// Additionally hold egress packets for `delay` plus a uniform random `[0, jitter)`.
+    /// Requires the `fq` qdisc on the interface (`setup-tc.sh edt`); jitter may reorder packets.
+    pub fn with_delay(self, delay: Duration, jitter: Duration) -> Self {
+        Self {
+            delay_ns: delay.as_nanos() as u64,
+            jitter_ns: jitter.as_nanos().min(u32::MAX as u128) as u32,
+            ..self
+        }
+    }
+
+    /// Drop UDP packets whose sequence number (see `rtp::PacketHeader`) is a multiple of `every`
+    /// with `drop_threshold` instead, e.g. 0 to protect every `every`-th packet from loss, or
+    /// `u32::MAX` to always lose it. Other packets keep the drop model's threshold.
+    pub fn with_seq_class(self, every: u32, drop_threshold: u32) -> Self {
+        Self {
+            seq_class_every: every,
+            seq_class_threshold: drop_threshold,
+            ..self
+        }
+    }
+
+    /// Flip one random bit in the UDP payload (including the RTP-like header) of targeted packets
+    /// with `threshold`. With `fix_checksum`, the UDP checksum is patched so that the damage
+    /// reaches the application; otherwise the receiving kernel discards the packet, unless the
+    /// NIC already validated the checksum. Needs [`Stage::Corrupt`].
+    pub fn with_corruption(self, threshold: u32, fix_checksum: bool) -> Self {
+        Self {
+            corrupt_threshold: threshold,
+            corrupt_fix_csum: fix_checksum as u32,
+            ..self
+        }
+    }
+
+    /// Cut the UDP payload of targeted IPv4 packets down to `payload_len` bytes with
+    /// `threshold`. Truncated packets are sent on without a UDP checksum. Needs
+    /// [`Stage::Truncate`].
+    pub fn with_truncation(self, threshold: u32, payload_len: u32) -> Self {
+        Self {
+            truncate_threshold: threshold,
+            truncate_len: payload_len,
+            ..self
+        }
+    }
+
+    /// Hold egress packets back by `hold` with `threshold`, so that the packets the flow sends
+    /// during `hold` overtake them. Like [`KeymashConfig::with_delay`], this needs the `fq`
+    /// qdisc (`setup-tc.sh edt`). Needs [`Stage::Reorder`].
+    pub fn with_reorder(self, threshold: u32, hold: Duration) -> Self {
+        Self {
+            reorder_threshold: threshold,
+            reorder_ns: hold.as_nanos().min(u32::MAX as u128) as u32,
+            ..self
+        }
+    }
+
+    /// Derive every random decision from `seed` and the packet's index within its flow instead of
+    /// the kernel's PRNG, so that runs with the same seed and traffic see the same loss pattern.
+    /// Call [`BpfHandle::restart_sequence`] at the start of each run. Shaping still depends on
+    /// timing, and the offload build ignores the seed.
+    pub fn with_seed(self, seed: u64) -> Self {
+        Self {
+            seeded: 1,
+            seed,
+            ..self
+        }
+    }
+
+    /// Treat `drop_threshold` as the loss the targeted traffic should end up with, and let the
+    /// filter find the threshold that achieves it: every `interval` it compares the loss it
+    /// measured (including drops by shaping, sequence classes and bursts) with the target and
+    /// corrects its threshold. The target can still be changed through
+    /// [`BpfThresholdWriter::set_threshold`]. Needs [`Stage::Drop`]; the offload build ignores it.
+    pub fn with_target_loss(self, interval: Duration) -> Self {
+        Self {
+            ctl_mode: ControlMode::Loss,
+            ctl_interval_ns: interval.as_nanos().min(u32::MAX as u128) as u32,
+            ..self
+        }
+    }
+
+    /// Let the filter steer its drop threshold so that about `bytes_per_sec` of the targeted
+    /// traffic gets through, correcting every `interval`. Unlike
+    /// [`KeymashConfig::with_rate_limit`], this drops at random rather than the tail of a burst,
+    /// and the rate is shared by all flows of the profile. Needs [`Stage::Drop`].
+    pub fn with_target_rate(self, bytes_per_sec: u64, interval: Duration) -> Self {
+        Self {
+            ctl_mode: ControlMode::Rate,
+            ctl_interval_ns: interval.as_nanos().min(u32::MAX as u128) as u32,
+            ctl_target_rate: bytes_per_sec,
+            ..self
+        }
+    }
+
+    /// Split the drop threshold and the counters by RX queue, CPU or NUMA node, so that one of
+    /// them can be impaired on its own with [`BpfHandle::set_unit_threshold`] (e.g. to see how
+    /// RSS and the receiver's threads cope with one bad queue) and each be watched with
+    /// [`BpfHandle::read_unit_stats`]. Units without a threshold of their own keep
+    /// `drop_threshold`. A target loss or rate ignores the units' thresholds. The offload build
+    /// ignores the scope.
+    pub fn with_scope(self, scope: Scope) -> Self {
+        Self { scope, ..self }
+    }
+}
+
+/// Mirrors `struct keymash_ctl` in `bpf/bpf.c`. The spin lock reads as zero.
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+struct KeymashCtl {
+    lock: u32,
+    threshold: u32,
+    window_start_ns: u64,
+    packets: u64,
+    dropped: u64,
+    bytes: u64,
+    passed_bytes: u64,
+}
+
+/// Mirrors `struct keymash_stats` in `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+struct KeymashStatsEntry {
+    packets: u64,
+    bytes: u64,
+    segments: u64,
+}
+
+// Keep in sync with `enum keymash_dir` and `enum keymash_verdict` in `bpf/bpf.c`.
+const KEYMASH_DIR_INGRESS: u32 = 0;
+const KEYMASH_DIR_EGRESS: u32 = 1;
+const KEYMASH_VERDICT_PASS: u32 = 0;
+const KEYMASH_VERDICT_DROP: u32 = 1;
+const KEYMASH_VERDICT_MAX: u32 = 2;
+
+/// Packets and bytes of targeted traffic that the filter let through or dropped in one direction.
+///
+/// With GSO (or GRO on ingress) the filter sees one packet for several wire packets, its
+/// segments; see [`rtp::RtpSender::with_gso`](crate::rtp::RtpSender::with_gso).
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct DirectionStats {
+    pub passed_packets: u64,
+    pub passed_bytes: u64,
+    pub passed_segments: u64,
+    pub dropped_packets: u64,
+    pub dropped_bytes: u64,
+    pub dropped_segments: u64,
+}
+
+impl DirectionStats {
+    /// Fraction of wire packets that were dropped, or 0 if no packets were seen.
+    pub fn drop_rate(&self) -> f64 {
+        let total = self.passed_segments + self.dropped_segments;
+        if total == 0 {
+            0.0
+        } else {
+            self.dropped_segments as f64 / total as f64
+        }
+    }
+}
+
+/// Counters of the filter summed over all CPUs. See [`BpfHandle::read_stats`].
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub struct KeymashStats {
+    pub ingress: DirectionStats,
+    pub egress: DirectionStats,
+}
+
+/// Capacity of `map_keymash_profiles`; `KEYMASH_MAX_PROFILES` in `bpf/bpf.c`.
+pub const KEYMASH_MAX_PROFILES: usize = 1024;
+
+/// Number of queues, CPUs or NUMA nodes the filter keeps apart; `KEYMASH_MAX_UNITS` in
+/// `bpf/bpf.c`. See [`KeymashConfig::with_scope`].
+pub const KEYMASH_MAX_UNITS: usize = 256;
+
+/// Number of log2 buckets per direction in `map_keymash_latency`.
+pub const LATENCY_BUCKETS: usize = 64;
+
+/// Histogram of the filter's own run time per packet, summed over all CPUs.
+/// Bucket `i` counts packets that took `[2^i, 2^(i+1))` ns (bucket 0 also counts 0 ns).
+/// See [`BpfHandle::read_latency`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct LatencyHistogram {
+    pub ingress: [u64; LATENCY_BUCKETS],
+    pub egress: [u64; LATENCY_BUCKETS],
+}
+
+/// Upper bound in ns of the bucket that holds the `q`-quantile of `buckets`, or `None` if the
+/// histogram is empty.
+pub fn latency_quantile(buckets: &[u64; LATENCY_BUCKETS], q: f64) -> Option<u64> {
+    let total: u64 = buckets.iter().sum();
+    if total == 0 {
+        return None;
+    }
+    let rank = (q.clamp(0.0, 1.0) * total as f64).ceil().max(1.0) as u64;
+    let mut seen = 0;
+    for (i, &count) in buckets.iter().enumerate() {
+        seen += count;
+        if seen >= rank {
+            return Some(1u64.checked_shl(i as u32 + 1).unwrap_or(u64::MAX));
+        }
+    }
+    None
+}
 
 #[derive(Debug)]
 pub struct BpfHandle {
     map_fd: c_int,
+    active_fd: c_int,
+    /// Generation of the config that is live in the filter.
+    generation: AtomicU32,
+    flows_fd: c_int,
+    profiles_fd: c_int,
+    stats_fd: c_int,
+    /// Whether the map was built with `-DKEYMASH_PERCPU_MAP` (see `bpf/bpf.c`).
+    percpu: bool,
+    /// Number of possible CPUs; the length of a per-CPU value.
+    nr_cpus: usize,
+    /// Whether the counters are per-CPU; they are shared in the `-DKEYMASH_OFFLOAD` build.
+    stats_percpu: bool,
 }
 
 #[derive(Debug, Clone, Copy)]
 pub enum BpfError {
     LoadMap(c_int),
+    MapInfo(c_int),
     MapWrite(c_int),
+    MapDelete(c_int),
+    MapRead(c_int),
+    MapMmap(c_int),
+    Poll(c_int),
+    LoadObject(c_int),
+    Attach(c_int),
 }
 
-/// Opens the eBPF map.
-pub unsafe fn init() -> Result<BpfHandle, BpfError> {
-    let res = bpf_obj_get(BPF_MAP_NAME.as_ptr());
+unsafe fn open_map(path: &CStr) -> Result<c_int, BpfError> {
+    let res = bpf_obj_get(path.as_ptr());
     if res < 0 {
-        log::error!("Failed to load BPF map {BPF_MAP_NAME:?}: {}", res);
+        log::error!("Failed to load BPF map {path:?}: {}", res);
         return Err(BpfError::LoadMap(res));
     }
-    Ok(BpfHandle { map_fd: res })
+    Ok(res)
+}
+
+/// The layouts are compile-time choices in `bpf.c`; ask the kernel which one we got.
+unsafe fn map_info(map_fd: c_int, path: &CStr) -> Result<bpf_map_info, BpfError> {
+    let mut info: bpf_map_info = std::mem::zeroed();
+    let mut info_len = size_of::<bpf_map_info>() as u32;
+    let res = bpf_map_get_info_by_fd(map_fd, &mut info, &mut info_len);
+    if res != 0 {
+        log::error!("Failed to query BPF map {path:?}: {}", res);
+        return Err(BpfError::MapInfo(res));
+    }
+    Ok(info)
+}
+
+unsafe fn map_type(map_fd: c_int, path: &CStr) -> Result<u32, BpfError> {
+    Ok(map_info(map_fd, path)?.type_)
+}
+
+/// Fails unless the map's values are `value_size` bytes (and there are `max_entries` of them, if
+/// given), so that a pin left by another build of `bpf.c` is reported rather than misread.
+unsafe fn check_layout(map_fd: c_int, path: &CStr, value_size: usize, max_entries: Option<usize>) -> Result<(), BpfError> {
+    let info = map_info(map_fd, path)?;
+    if info.value_size as usize != value_size || max_entries.is_some_and(|n| info.max_entries as usize != n) {
+        log::error!(
+            "BPF map {path:?} has {} values of {} bytes, expected {} of {value_size}; remove the stale pin and reload bpf.o",
+            info.max_entries,
+            info.value_size,
+            max_entries.map_or("any number".to_string(), |n| n.to_string()),
+        );
+        return Err(BpfError::MapInfo(-libc::EINVAL));
+    }
+    Ok(())
+}
+
+/// Opens the eBPF maps.
+pub unsafe fn init() -> Result<BpfHandle, BpfError> {
+    // dropping the handle on an early return closes whatever was opened so far
+    let mut handle = BpfHandle {
+        map_fd: -1,
+        active_fd: -1,
+        generation: AtomicU32::new(0),
+        flows_fd: -1,
+        profiles_fd: -1,
+        stats_fd: -1,
+        percpu: false,
+        nr_cpus: 1,
+        stats_percpu: true,
+    };
+    handle.map_fd = open_map(BPF_MAP_NAME)?;
+    handle.active_fd = open_map(BPF_ACTIVE_MAP_NAME)?;
+    handle.flows_fd = open_map(BPF_FLOWS_MAP_NAME)?;
+    handle.profiles_fd = open_map(BPF_PROFILES_MAP_NAME)?;
+    handle.stats_fd = open_map(BPF_STATS_MAP_NAME)?;
+
+    check_layout(handle.map_fd, BPF_MAP_NAME, KEYMASH_CONFIG_SIZE, Some(2))?;
+    handle.percpu = map_type(handle.map_fd, BPF_MAP_NAME)? == BPF_MAP_TYPE_PERCPU_ARRAY;
+    handle.stats_percpu = map_type(handle.stats_fd, BPF_STATS_MAP_NAME)? == BPF_MAP_TYPE_PERCPU_ARRAY;
+
+    let nr_cpus = libbpf_num_possible_cpus();
+    if nr_cpus <= 0 {
+        log::error!("Failed to count possible CPUs: {}", nr_cpus);
+        return Err(BpfError::MapInfo(nr_cpus));
+    }
+
+    handle.nr_cpus = nr_cpus as usize;
+
+    // carry on from the live generation, so that a restart never rewrites the live slot
+    let generation = if handle.percpu {
+        lookup_percpu::<u64>(handle.active_fd, 0, handle.nr_cpus)?[0] as u32
+    } else {
+        lookup_elem::<u32>(handle.active_fd, 0)?
+    };
+    handle.generation.store(generation, Ordering::Relaxed);
+    Ok(handle)
 }
 
 impl BpfHandle {
-    /// Write a key-value pair to the eBPF map.
-    pub fn write_to_map(&self, key: u32, value: u32) -> Result<(), BpfError> {
-        unsafe {
-            let res = libbpf_sys::bpf_map_update_elem(
-                self.map_fd,
-                &key as *const u32 as *const c_void,
-                &value as *const u32 as *const c_void,
-                BPF_ANY.into(),
+    /// Publish a new config to the filter.
+    ///
+    /// The config is written whole into the slot the filter is not reading, and only then made
+    /// live by bumping the generation, so the filter never sees a mix of old and new parameters.
+    /// Calls must not race with each other.
+    pub fn write_to_map(&self, config: &KeymashConfig) -> Result<(), BpfError> {
+        let generation = self.generation.load(Ordering::Relaxed).wrapping_add(1);
+        let config = KeymashConfig {
+            generation,
+            generation_end: generation,
+            ..*config
+        };
+        self.write_to_all_cpus(self.map_fd, generation & 1, &config)?;
+        self.write_to_all_cpus(self.active_fd, 0, &generation)?;
+        self.generation.store(generation, Ordering::Relaxed);
+        Ok(())
+    }
+
+    /// Write a value to a map that follows the `KEYMASH_PERCPU_MAP` layout switch.
+    /// For the per-CPU layout, every CPU's copy is written with a single update.
+    fn write_to_all_cpus<T: Copy>(&self, map_fd: c_int, key: u32, value: &T) -> Result<(), BpfError> {
+        let key = &key as *const u32 as *const c_void;
+        if self.percpu {
+            let values = percpu_values(as_bytes(value), self.nr_cpus);
+            update_elem(map_fd, key, values.as_ptr() as *const c_void)
+        } else {
+            update_elem(map_fd, key, value as *const T as *const c_void)
+        }
+    }
+
+    /// Impair packets of the given protocol whose source or destination port is `port`, with the
+    /// config published by [`BpfHandle::write_to_map`].
+    /// Packets that match no target flow are never dropped.
+    pub fn add_target_flow(&self, proto: FlowProto, port: u16) -> Result<(), BpfError> {
+        self.add_target_flow_with_profile(proto, port, 0)
+    }
+
+    /// Like [`BpfHandle::add_target_flow`], but impair the flow with the given profile (see
+    /// [`BpfHandle::create_profile`]). Profile 0, or one that does not exist, means the config
+    /// published by [`BpfHandle::write_to_map`].
+    pub fn add_target_flow_with_profile(&self, proto: FlowProto, port: u16, profile: u32) -> Result<(), BpfError> {
+        let flow = KeymashFlow::new(proto, port);
+        update_elem(
+            self.flows_fd,
+            &flow as *const KeymashFlow as *const c_void,
+            &profile as *const u32 as *const c_void,
+        )
+    }
+
+    /// Create, or replace, the impairment profile `id`, so that several sessions can share a NIC
+    /// with their own configs.
+    ///
+    /// A packet uses profile `id` if the net_cls classid of its cgroup is `id`, or else if its
+    /// flow was added with [`BpfHandle::add_target_flow_with_profile`]. The config replaces the
+    /// old one in a single update; unlike [`BpfHandle::write_to_map`], `map_keymash_fast` does
+    /// not override it.
+    pub fn create_profile(&self, id: u32, config: &KeymashConfig) -> Result<(), BpfError> {
+        assert!(id != 0, "profile 0 is the config published with write_to_map");
+        update_elem(
+            self.profiles_fd,
+            &id as *const u32 as *const c_void,
+            config as *const KeymashConfig as *const c_void,
+        )
+    }
+
+    /// Remove profile `id`; its packets fall back to the config published with
+    /// [`BpfHandle::write_to_map`]. Flows that refer to it are left in place.
+    pub fn retire_profile(&self, id: u32) -> Result<(), BpfError> {
+        unsafe {
+            let res = libbpf_sys::bpf_map_delete_elem(self.profiles_fd, &id as *const u32 as *const c_void);
+            if res != 0 {
+                log::error!("Failed to delete from BPF map: {}", res);
+                return Err(BpfError::MapDelete(res));
+            }
+        }
+        Ok(())
+    }
+
+    /// Create or replace many profiles (see [`BpfHandle::create_profile`]) in a single syscall.
+    pub fn write_profiles(&self, profiles: &[(u32, KeymashConfig)]) -> Result<(), BpfError> {
+        assert!(profiles.iter().all(|(id, _)| *id != 0), "profile 0 is the config published with write_to_map");
+        let (ids, configs): (Vec<u32>, Vec<KeymashConfig>) = profiles.iter().copied().unzip();
+        unsafe { update_batch(self.profiles_fd, &ids, &configs) }
+    }
+
+    /// All profiles that currently exist, in no particular order, read in a single syscall
+    /// (or a few, for a full map).
+    pub fn read_profiles(&self) -> Result<Vec<(u32, KeymashConfig)>, BpfError> {
+        let (ids, configs) =
+            unsafe { lookup_batch::<u32, KeymashConfig>(self.profiles_fd, KEYMASH_MAX_PROFILES, 1)? };
+        Ok(ids.into_iter().zip(configs).collect())
+    }
+
+    /// Stop impairing a flow previously added with [`BpfHandle::add_target_flow`].
+    pub fn remove_target_flow(&self, proto: FlowProto, port: u16) -> Result<(), BpfError> {
+        let flow = KeymashFlow::new(proto, port);
+        unsafe {
+            let res = libbpf_sys::bpf_map_delete_elem(
+                self.flows_fd,
+                &flow as *const KeymashFlow as *const c_void,
             );
             if res != 0 {
-                log::error!("Failed to write to BPF map: {}", res);
-                return Err(BpfError::MapWrite(res));
+                log::error!("Failed to delete from BPF map: {}", res);
+                return Err(BpfError::MapDelete(res));
             }
         }
         Ok(())
     }
+
+    /// Restart the packet indices that seeded configs draw from (see [`KeymashConfig::with_seed`]),
+    /// along with the Gilbert-Elliott chains, so the next packet of every flow is packet 0 again.
+    pub fn restart_sequence(&self) -> Result<(), BpfError> {
+        unsafe {
+            clear_map::<KeymashFlow>(BPF_SEQ_MAP_NAME)?;
+            clear_map::<u32>(BPF_GE_STATE_MAP_NAME)
+        }
+    }
+
+    /// The drop threshold the controller of a profile (0 for the host-wide config) currently
+    /// applies, or `None` if it has not seen a packet yet. See [`KeymashConfig::with_target_loss`].
+    pub fn control_threshold(&self, profile: u32) -> Result<Option<u32>, BpfError> {
+        let map_fd = unsafe { open_map(BPF_CTL_MAP_NAME)? };
+        let ctl = lookup_elem::<KeymashCtl>(map_fd, profile);
+        unsafe {
+            libc::close(map_fd);
+        }
+        match ctl {
+            Ok(ctl) => Ok(Some(ctl.threshold)),
+            Err(BpfError::MapRead(err)) if err == -libc::ENOENT => Ok(None),
+            Err(err) => Err(err),
+        }
+    }
+
+    /// Forget what the controllers have learned, e.g. after switching between a target loss and
+    /// a target rate; they start over on the next packet.
+    pub fn reset_controllers(&self) -> Result<(), BpfError> {
+        unsafe { clear_map::<u32>(BPF_CTL_MAP_NAME) }
+    }
+
+    /// Packets the filter let through unparsed while bypassed (see
+    /// [`BpfThresholdWriter::set_bypass`]), as `[ingress, egress]` summed over all CPUs. They
+    /// are counted here only. Fails with [`BpfError::LoadMap`] on the offload build.
+    pub fn read_bypassed(&self) -> Result<[u64; 2], BpfError> {
+        let map_fd = unsafe { open_map(BPF_BYPASSED_MAP_NAME)? };
+        let entries = unsafe {
+            let entries = lookup_batch::<u32, u64>(map_fd, 2, self.nr_cpus);
+            libc::close(map_fd);
+            entries?
+        };
+        let mut bypassed = [0; 2];
+        for (key, per_cpu) in entries.0.iter().zip(entries.1.chunks(self.nr_cpus)) {
+            if let Some(count) = bypassed.get_mut(*key as usize) {
+                *count = per_cpu.iter().sum();
+            }
+        }
+        Ok(bypassed)
+    }
+
+    /// Read the run-time histogram of the filter. Only the `-DKEYMASH_INSTRUMENT` build of
+    /// `bpf.c` has it; otherwise this fails with [`BpfError::LoadMap`].
+    pub fn read_latency(&self) -> Result<LatencyHistogram, BpfError> {
+        let map_fd = unsafe { open_map(BPF_LATENCY_MAP_NAME)? };
+        let entries = unsafe {
+            let entries = lookup_batch::<u32, u64>(map_fd, 2 * LATENCY_BUCKETS, self.nr_cpus);
+            libc::close(map_fd);
+            entries?
+        };
+        let mut histogram = LatencyHistogram {
+            ingress: [0; LATENCY_BUCKETS],
+            egress: [0; LATENCY_BUCKETS],
+        };
+        for (key, per_cpu) in entries.0.iter().zip(entries.1.chunks(self.nr_cpus)) {
+            let (dir, bucket) = (*key as usize / LATENCY_BUCKETS, *key as usize % LATENCY_BUCKETS);
+            let buckets = if dir == KEYMASH_DIR_INGRESS as usize {
+                &mut histogram.ingress
+            } else {
+                &mut histogram.egress
+            };
+            buckets[bucket] = per_cpu.iter().sum();
+        }
+        Ok(histogram)
+    }
+
+    /// Read the filter's packet and byte counters, summed over all CPUs.
+    /// The counters only cover flows added with [`BpfHandle::add_target_flow`].
+    pub fn read_stats(&self) -> Result<KeymashStats, BpfError> {
+        let nr_entries = (2 * KEYMASH_VERDICT_MAX) as usize;
+        let entries: Vec<KeymashStatsEntry> = if self.stats_percpu {
+            // every CPU's counters in a single syscall
+            unsafe { self.read_percpu_stats(self.stats_fd, nr_entries)? }
+        } else {
+            // offloaded maps don't do batch operations
+            (0..nr_entries as u32)
+                .map(|key| lookup_elem(self.stats_fd, key))
+                .collect::<Result<_, _>>()?
+        };
+        if entries.len() != nr_entries {
+            return Err(BpfError::MapRead(-libc::ENOENT));
+        }
+        Ok(stats_from_entries(&entries))
+    }
+
+    /// Give one unit (a queue, CPU or NUMA node, per [`KeymashConfig::with_scope`]) its own drop
+    /// threshold, or `None` to go back to the config's. Fails for units past
+    /// [`KEYMASH_MAX_UNITS`], and with [`BpfError::LoadMap`] on the offload build.
+    pub fn set_unit_threshold(&self, unit: u32, drop_threshold: Option<u32>) -> Result<(), BpfError> {
+        // a struct keymash_unit
+        let value: [u32; 2] = [drop_threshold.is_some() as u32, drop_threshold.unwrap_or(0)];
+        let map_fd = unsafe { open_map(BPF_UNITS_MAP_NAME)? };
+        let res = update_elem(
+            map_fd,
+            &unit as *const u32 as *const c_void,
+            value.as_ptr() as *const c_void,
+        );
+        unsafe {
+            libc::close(map_fd);
+        }
+        res
+    }
+
+    /// Read the counters of every unit that has seen targeted traffic, indexed by unit, as
+    /// [`BpfHandle::read_stats`] does for the host. Packets are counted under the scope of the
+    /// config that impaired them, so mixing scopes across profiles mixes the meaning of a unit.
+    pub fn read_unit_stats(&self) -> Result<Vec<(u32, KeymashStats)>, BpfError> {
+        let per_unit = (2 * KEYMASH_VERDICT_MAX) as usize;
+        let map_fd = unsafe { open_map(BPF_UNIT_STATS_MAP_NAME)? };
+        let entries = unsafe {
+            let entries = self.read_percpu_stats(map_fd, KEYMASH_MAX_UNITS * per_unit);
+            libc::close(map_fd);
+            entries?
+        };
+        Ok(entries
+            .chunks_exact(per_unit)
+            .enumerate()
+            .map(|(unit, entries)| (unit as u32, stats_from_entries(entries)))
+            .filter(|(_, stats)| *stats != KeymashStats::default())
+            .collect())
+    }
+
+    /// Every entry of a per-CPU array of `struct keymash_stats`, summed over all CPUs.
+    unsafe fn read_percpu_stats(&self, map_fd: c_int, nr_entries: usize) -> Result<Vec<KeymashStatsEntry>, BpfError> {
+        let (_, per_cpu) = lookup_batch::<u32, KeymashStatsEntry>(map_fd, nr_entries, self.nr_cpus)?;
+        Ok(per_cpu
+            .chunks(self.nr_cpus)
+            .map(|cpus| {
+                cpus.iter().fold(KeymashStatsEntry::default(), |acc, e| KeymashStatsEntry {
+                    packets: acc.packets + e.packets,
+                    bytes: acc.bytes + e.bytes,
+                    segments: acc.segments + e.segments,
+                })
+            })
+            .collect())
+    }
+}
+
+/// Splits the counters of both directions, indexed by `direction * KEYMASH_VERDICT_MAX + verdict`.
+fn stats_from_entries(entries: &[KeymashStatsEntry]) -> KeymashStats {
+    let read_direction = |dir: u32| {
+        let passed = entries[(dir * KEYMASH_VERDICT_MAX + KEYMASH_VERDICT_PASS) as usize];
+        let dropped = entries[(dir * KEYMASH_VERDICT_MAX + KEYMASH_VERDICT_DROP) as usize];
+        DirectionStats {
+            passed_packets: passed.packets,
+            passed_bytes: passed.bytes,
+            passed_segments: passed.segments,
+            dropped_packets: dropped.packets,
+            dropped_bytes: dropped.bytes,
+            dropped_segments: dropped.segments,
+        }
+    };
+    KeymashStats {
+        ingress: read_direction(KEYMASH_DIR_INGRESS),
+        egress: read_direction(KEYMASH_DIR_EGRESS),
+    }
+}
+
+/// Read up to `max_entries` entries of a map with `BPF_MAP_LOOKUP_BATCH`, each with
+/// `values_per_key` values (the number of CPUs for per-CPU maps). Returns the keys and the
+/// values, `values_per_key` per key.
+unsafe fn lookup_batch<K: Default + Clone, V: Default + Clone>(
+    map_fd: c_int,
+    max_entries: usize,
+    values_per_key: usize,
+) -> Result<(Vec<K>, Vec<V>), BpfError> {
+    debug_assert!(values_per_key == 1 || size_of::<V>() % 8 == 0);
+    let mut keys = vec![K::default(); max_entries];
+    let mut values = vec![V::default(); max_entries * values_per_key];
+    let mut opts: libbpf_sys::bpf_map_batch_opts = std::mem::zeroed();
+    opts.sz = size_of::<libbpf_sys::bpf_map_batch_opts>() as _;
+
+    // the batch position is opaque, but a u32 for array and hash maps
+    let (mut in_batch, mut out_batch) = (0u32, 0u32);
+    let mut done = 0;
+    while done < max_entries {
+        let mut count = (max_entries - done) as u32;
+        let res = libbpf_sys::bpf_map_lookup_batch(
+            map_fd,
+            if done == 0 { std::ptr::null_mut() } else { &mut in_batch as *mut u32 as *mut c_void },
+            &mut out_batch as *mut u32 as *mut c_void,
+            keys[done..].as_mut_ptr() as *mut c_void,
+            values[done * values_per_key..].as_mut_ptr() as *mut c_void,
+            &mut count,
+            &opts,
+        );
+        done += count as usize;
+        // ENOENT means the end of the map was reached; count still holds the last entries
+        if res == -libc::ENOENT {
+            break;
+        }
+        if res != 0 {
+            log::error!("Failed to batch read from BPF map: {}", res);
+            return Err(BpfError::MapRead(res));
+        }
+        in_batch = out_batch;
+    }
+    keys.truncate(done);
+    values.truncate(done * values_per_key);
+    Ok((keys, values))
+}
+
+/// Write `keys[i]` -> `values[i]` for all `i` with a single `BPF_MAP_UPDATE_BATCH`.
+unsafe fn update_batch<K, V>(map_fd: c_int, keys: &[K], values: &[V]) -> Result<(), BpfError> {
+    assert_eq!(keys.len(), values.len());
+    let mut opts: libbpf_sys::bpf_map_batch_opts = std::mem::zeroed();
+    opts.sz = size_of::<libbpf_sys::bpf_map_batch_opts>() as _;
+    opts.elem_flags = BPF_ANY.into();
+
+    let mut count = keys.len() as u32;
+    let res = libbpf_sys::bpf_map_update_batch(
+        map_fd,
+        keys.as_ptr() as *const c_void,
+        values.as_ptr() as *const c_void,
+        &mut count,
+        &opts,
+    );
+    if res != 0 {
+        log::error!("Failed to batch write to BPF map ({count} of {} written): {}", keys.len(), res);
+        return Err(BpfError::MapWrite(res));
+    }
+    Ok(())
+}
+
+/// Delete every entry of the pinned hash map at `path`, whose keys are `K`s.
+unsafe fn clear_map<K>(path: &CStr) -> Result<(), BpfError> {
+    let map_fd = open_map(path)?;
+    let mut key = std::mem::MaybeUninit::<K>::uninit();
+    let mut res = 0;
+    // always restart from the first key, since the previous one is gone
+    while libbpf_sys::bpf_map_get_next_key(map_fd, std::ptr::null(), key.as_mut_ptr() as *mut c_void) == 0 {
+        res = libbpf_sys::bpf_map_delete_elem(map_fd, key.as_ptr() as *const c_void);
+        if res != 0 {
+            break;
+        }
+    }
+    libc::close(map_fd);
+    if res != 0 {
+        log::error!("Failed to delete from BPF map {path:?}: {}", res);
+        return Err(BpfError::MapDelete(res));
+    }
+    Ok(())
+}
+
+/// The bytes of a plain-old-data `#[repr(C)]` value, for writing into a map.
+fn as_bytes<T: Copy>(value: &T) -> &[u8] {
+    unsafe { std::slice::from_raw_parts(value as *const T as *const u8, size_of::<T>()) }
+}
+
+/// Builds the value buffer of a per-CPU map update that gives every CPU the same `value`.
+fn percpu_values(value: &[u8], nr_cpus: usize) -> Vec<u8> {
+    // the kernel expects one slot per possible CPU, each padded to 8 bytes
+    let slot = value.len().next_multiple_of(8);
+    let mut values = vec![0u8; slot * nr_cpus];
+    for chunk in values.chunks_exact_mut(slot) {
+        chunk[..value.len()].copy_from_slice(value);
+    }
+    values
+}
+
+/// Look up `key` in a map with plain-old-data values.
+fn lookup_elem<T: Default>(map_fd: c_int, key: u32) -> Result<T, BpfError> {
+    let mut value = T::default();
+    unsafe {
+        let res = libbpf_sys::bpf_map_lookup_elem(
+            map_fd,
+            &key as *const u32 as *const c_void,
+            &mut value as *mut T as *mut c_void,
+        );
+        if res != 0 {
+            log::error!("Failed to read from BPF map: {}", res);
+            return Err(BpfError::MapRead(res));
+        }
+    }
+    Ok(value)
+}
+
+/// Look up every CPU's copy of `key` in a per-CPU map.
+/// `T` must have a size that is a multiple of 8, as the kernel pads each CPU's slot to 8 bytes.
+fn lookup_percpu<T: Default + Clone>(map_fd: c_int, key: u32, nr_cpus: usize) -> Result<Vec<T>, BpfError> {
+    debug_assert!(size_of::<T>() % 8 == 0);
+    let mut values = vec![T::default(); nr_cpus];
+    unsafe {
+        let res = libbpf_sys::bpf_map_lookup_elem(
+            map_fd,
+            &key as *const u32 as *const c_void,
+            values.as_mut_ptr() as *mut c_void,
+        );
+        if res != 0 {
+            log::error!("Failed to read from BPF map: {}", res);
+            return Err(BpfError::MapRead(res));
+        }
+    }
+    Ok(values)
+}
+
+fn update_elem(map_fd: c_int, key: *const c_void, value: *const c_void) -> Result<(), BpfError> {
+    unsafe {
+        let res = libbpf_sys::bpf_map_update_elem(map_fd, key, value, BPF_ANY.into());
+        if res != 0 {
+            log::error!("Failed to write to BPF map: {}", res);
+            return Err(BpfError::MapWrite(res));
+        }
+    }
+    Ok(())
 }
 
 impl Drop for BpfHandle {
     fn drop(&mut self) {
         unsafe {
             libc::close(self.map_fd);
+            libc::close(self.active_fd);
+            libc::close(self.flows_fd);
+            libc::close(self.profiles_fd);
+            libc::close(self.stats_fd);
+        }
+    }
+}
+
+/// Have `scream_xdp_xsk` redirect the packets to UDP `port` that arrive on `queue` and survive
+/// impairment into the AF_XDP socket `xsk_fd`. See [`crate::xsk::XskSocket`].
+pub unsafe fn register_xsk(queue: u32, xsk_fd: c_int, port: u16) -> Result<(), BpfError> {
+    let xsks_fd = open_map(BPF_XSKS_MAP_NAME)?;
+    let res = update_elem(
+        xsks_fd,
+        &queue as *const u32 as *const c_void,
+        &xsk_fd as *const c_int as *const c_void,
+    );
+    libc::close(xsks_fd);
+    res?;
+
+    let ports_fd = open_map(BPF_XSK_PORTS_MAP_NAME)?;
+    let res = update_elem(
+        ports_fd,
+        &port as *const u16 as *const c_void,
+        &0u32 as *const u32 as *const c_void,
+    );
+    libc::close(ports_fd);
+    res
+}
+
+/// Undo [`register_xsk`]; `port`'s packets take the regular network stack again.
+pub unsafe fn unregister_xsk(queue: u32, port: u16) -> Result<(), BpfError> {
+    for (path, key) in [
+        (BPF_XSK_PORTS_MAP_NAME, &port as *const u16 as *const c_void),
+        (BPF_XSKS_MAP_NAME, &queue as *const u32 as *const c_void),
+    ] {
+        let map_fd = open_map(path)?;
+        let res = libbpf_sys::bpf_map_delete_elem(map_fd, key);
+        libc::close(map_fd);
+        if res != 0 && res != -libc::ENOENT {
+            log::error!("Failed to delete from BPF map: {}", res);
+            return Err(BpfError::MapDelete(res));
+        }
+    }
+    Ok(())
+}
+
+/// Mirrors `struct keymash_fast` in `bpf/bpf.c`.
+#[repr(C)]
+struct KeymashFast {
+    overrides: AtomicU32,
+    drop_threshold: AtomicU32,
+    bypass: AtomicU32,
+}
+
+/// Sets the filter's drop threshold through the memory-mapped `map_keymash_fast`, without a
+/// syscall per update.
+///
+/// While the writer exists, its threshold replaces the `drop_threshold` of the config published
+/// with [`BpfHandle::write_to_map`]; every other parameter still comes from the published config.
+pub struct BpfThresholdWriter {
+    map_fd: c_int,
+    page_size: usize,
+    mem: *mut c_void,
+}
+
+// The mapping is only accessed through atomics.
+unsafe impl Send for BpfThresholdWriter {}
+unsafe impl Sync for BpfThresholdWriter {}
+
+/// Maps `map_keymash_fast` and takes over the drop threshold, starting at `drop_threshold`.
+pub unsafe fn open_threshold_writer(drop_threshold: u32) -> Result<BpfThresholdWriter, BpfError> {
+    let map_fd = open_map(BPF_FAST_MAP_NAME)?;
+    let page_size = libc::sysconf(libc::_SC_PAGESIZE) as usize;
+
+    let mem = libc::mmap(
+        std::ptr::null_mut(),
+        page_size,
+        libc::PROT_READ | libc::PROT_WRITE,
+        libc::MAP_SHARED,
+        map_fd,
+        0,
+    );
+    if mem == libc::MAP_FAILED {
+        let err = *libc::__errno_location();
+        log::error!("Failed to mmap BPF map {BPF_FAST_MAP_NAME:?}: {}", err);
+        libc::close(map_fd);
+        return Err(BpfError::MapMmap(err));
+    }
+
+    let writer = BpfThresholdWriter { map_fd, page_size, mem };
+    // whatever an earlier writer left behind must not apply, not even for a packet
+    writer.fast().drop_threshold.store(drop_threshold, Ordering::Relaxed);
+    writer.fast().bypass.store(0, Ordering::Relaxed);
+    writer.fast().overrides.store(1, Ordering::Release);
+    Ok(writer)
+}
+
+impl BpfThresholdWriter {
+    fn fast(&self) -> &KeymashFast {
+        unsafe { &*(self.mem as *const KeymashFast) }
+    }
+
+    /// Set the drop threshold the filter applies from its next packet on.
+    pub fn set_threshold(&self, drop_threshold: u32) {
+        self.fast().drop_threshold.store(drop_threshold, Ordering::Relaxed);
+    }
+
+    /// Switch the filter off, or back on. While off, the entry programs pass every packet
+    /// before parsing it and only count it in [`BpfHandle::read_bypassed`]: the stats, latency,
+    /// feedback and event maps see none of them, and profiles and controllers stand still. Meant
+    /// for stretches without any impairment on a host that uses neither.
+    pub fn set_bypass(&self, bypass: bool) {
+        self.fast().bypass.store(bypass as u32, Ordering::Relaxed);
+    }
+}
+
+impl Drop for BpfThresholdWriter {
+    fn drop(&mut self) {
+        // hand the threshold back to the published config, with the filter on
+        self.fast().overrides.store(0, Ordering::Release);
+        self.fast().bypass.store(0, Ordering::Release);
+        unsafe {
+            libc::munmap(self.mem, self.page_size);
+            libc::close(self.map_fd);
+        }
+    }
+}
+
+/// Mirrors `struct keymash_feedback` in `bpf/bpf.c`.
+#[repr(C)]
+struct KeymashFeedback {
+    packets: AtomicU64,
+    dropped: AtomicU64,
+    bytes: AtomicU64,
+    passed_bytes: AtomicU64,
+    _pad: [u64; 4],
+}
+
+/// What happened to the targeted traffic of one direction between two [`BpfFeedback::poll`]s.
+#[derive(Debug, Default, Clone, Copy, PartialEq)]
+pub struct Feedback {
+    /// Wire packets that got a verdict.
+    pub packets: u64,
+    /// Fraction of them that were dropped, or 0 if there were none.
+    pub loss: f64,
+    /// Bytes that got through, per second.
+    pub passed_bytes_per_sec: f64,
+}
+
+/// Reads the filter's loss and rate counters through the memory-mapped `map_keymash_feedback`,
+/// so that a sender on the same host can adapt its encoder to the impairment as it happens: a
+/// poll is a few loads per CPU, instead of a report from the receiver a round trip later.
+pub struct BpfFeedback {
+    map_fd: c_int,
+    mem: *mut c_void,
+    mem_len: usize,
+    /// Entries (CPUs) to sum, per direction.
+    nr_cpus: usize,
+    dir: u32,
+    /// Packets, dropped packets and passed bytes at the previous poll.
+    last: [u64; 3],
+    last_at: Instant,
+}
+
+// The mapping is only read through atomics.
+unsafe impl Send for BpfFeedback {}
+
+/// Maps `map_keymash_feedback` to read the counters of `dir`.
+pub unsafe fn open_feedback(dir: Direction) -> Result<BpfFeedback, BpfError> {
+    let nr_cpus = libbpf_num_possible_cpus();
+    if nr_cpus <= 0 {
+        log::error!("Failed to count possible CPUs: {}", nr_cpus);
+        return Err(BpfError::MapInfo(nr_cpus));
+    }
+    let map_fd = open_map(BPF_FEEDBACK_MAP_NAME)?;
+    // the entries are read in place, so a map of another build would be read out of bounds
+    if let Err(err) = check_layout(map_fd, BPF_FEEDBACK_MAP_NAME, size_of::<KeymashFeedback>(), Some(KEYMASH_MAX_UNITS * 2)) {
+        libc::close(map_fd);
+        return Err(err);
+    }
+    // CPUs past KEYMASH_MAX_UNITS have no entry
+    let mem_len = KEYMASH_MAX_UNITS * 2 * size_of::<KeymashFeedback>();
+    let mem = libc::mmap(std::ptr::null_mut(), mem_len, libc::PROT_READ, libc::MAP_SHARED, map_fd, 0);
+    if mem == libc::MAP_FAILED {
+        let err = *libc::__errno_location();
+        log::error!("Failed to mmap BPF map {BPF_FEEDBACK_MAP_NAME:?}: {}", err);
+        libc::close(map_fd);
+        return Err(BpfError::MapMmap(err));
+    }
+
+    let mut feedback = BpfFeedback {
+        map_fd,
+        mem,
+        mem_len,
+        nr_cpus: (nr_cpus as usize).min(KEYMASH_MAX_UNITS),
+        dir: match dir {
+            Direction::Ingress => KEYMASH_DIR_INGRESS,
+            Direction::Egress => KEYMASH_DIR_EGRESS,
+        },
+        last: [0; 3],
+        last_at: Instant::now(),
+    };
+    feedback.last = feedback.totals();
+    Ok(feedback)
+}
+
+impl BpfFeedback {
+    fn totals(&self) -> [u64; 3] {
+        let entries = self.mem as *const KeymashFeedback;
+        let mut totals = [0u64; 3];
+        for cpu in 0..self.nr_cpus {
+            let entry = unsafe { &*entries.add(cpu * 2 + self.dir as usize) };
+            // the filter updates the counters with plain stores, in no order a reader can rely
+            // on, so the totals are only approximately consistent: a packet in flight may
+            // show up in one counter and not yet in another, which poll's loss clamp absorbs
+            totals[0] += entry.packets.load(Ordering::Relaxed);
+            totals[1] += entry.dropped.load(Ordering::Relaxed);
+            totals[2] += entry.passed_bytes.load(Ordering::Relaxed);
+        }
+        totals
+    }
+
+    /// The loss and rate since the previous poll (or since opening).
+    pub fn poll(&mut self) -> Feedback {
+        let now = Instant::now();
+        let totals = self.totals();
+        let [packets, dropped, passed_bytes] = std::array::from_fn(|i| totals[i].wrapping_sub(self.last[i]));
+        let elapsed = now.duration_since(self.last_at).as_secs_f64();
+        self.last = totals;
+        self.last_at = now;
+        Feedback {
+            packets,
+            loss: if packets == 0 { 0.0 } else { (dropped as f64 / packets as f64).min(1.0) },
+            passed_bytes_per_sec: if elapsed > 0.0 { passed_bytes as f64 / elapsed } else { 0.0 },
+        }
+    }
+}
+
+impl Drop for BpfFeedback {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.mem, self.mem_len);
+            libc::close(self.map_fd);
+        }
+    }
+}
+
+/// Capacity of the ring that [`play_schedule`] streams steps through; `KEYMASH_SCHEDULE_STEPS`
+/// in `bpf/bpf.c`.
+pub const SCHEDULE_STEPS: usize = 4096;
+/// Steps are written in chunks of at least this many, so the player wakes up rarely.
+const SCHEDULE_CHUNK: usize = SCHEDULE_STEPS / 4;
+/// How long a step is kept in the ring after the next one took effect. A CPU that was busy with
+/// a packet right then may still be reading it.
+const SCHEDULE_SLACK: Duration = Duration::from_millis(1);
+
+/// One step of an impairment schedule, see [`play_schedule`]. Mirrors `struct keymash_step` in
+/// `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+#[repr(C)]
+pub struct ScheduleStep {
+    /// Time after the start of the schedule at which the step takes effect.
+    pub at_ns: u64,
+    rate_bytes_per_sec: u64,
+    delay_ns: u64,
+    drop_threshold: u32,
+    jitter_ns: u32,
+    burst_bytes: u32,
+    pad: u32,
+}
+
+impl ScheduleStep {
+    /// Drop packets with `drop_threshold` from `at` on, with no shaping or delay.
+    pub fn new(at: Duration, drop_threshold: u32) -> Self {
+        Self {
+            at_ns: at.as_nanos() as u64,
+            drop_threshold,
+            ..Default::default()
+        }
+    }
+
+    /// See [`KeymashConfig::with_rate_limit`].
+    pub fn with_rate_limit(self, rate_bytes_per_sec: u64, burst_bytes: u32) -> Self {
+        Self {
+            rate_bytes_per_sec,
+            burst_bytes,
+            ..self
+        }
+    }
+
+    /// See [`KeymashConfig::with_delay`].
+    pub fn with_delay(self, delay: Duration, jitter: Duration) -> Self {
+        Self {
+            delay_ns: delay.as_nanos() as u64,
+            jitter_ns: jitter.as_nanos().min(u32::MAX as u128) as u32,
+            ..self
+        }
+    }
+}
+
+/// Mirrors `struct keymash_schedule` in `bpf/bpf.c`.
+#[derive(Debug, Default, Clone, Copy)]
+#[repr(C)]
+struct KeymashSchedule {
+    start_ns: u64,
+    tail: u64,
+    head: u64,
+}
+
+/// `CLOCK_MONOTONIC`, which is what `ktime_get_ns` reads.
+fn monotonic_ns() -> u64 {
+    let mut ts: libc::timespec = unsafe { std::mem::zeroed() };
+    unsafe {
+        libc::clock_gettime(libc::CLOCK_MONOTONIC, &mut ts);
+    }
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+/// Play `steps`, sorted by `at_ns`, in the filter, starting now: at the time of each step, the
+/// filter itself swaps its loss, shaping and delay parameters into the host-wide config
+/// (profiles are unaffected). Unlike a [`BpfHandle::write_to_map`] per step, this keeps the
+/// timing to the microsecond with no thread spinning in userspace.
+///
+/// The steps are streamed into the kernel a chunk at a time, so `steps` can be as long as a
+/// trace gets, and this sleeps in between. Returns once the last step has taken effect; it stays
+/// in effect until [`stop_schedule`]. Shaping and delay need their [`Stage`]s.
+pub unsafe fn play_schedule(steps: impl IntoIterator<Item = ScheduleStep>) -> Result<(), BpfError> {
+    let steps_fd = open_map(BPF_SCHEDULE_MAP_NAME)?;
+    let state_fd = open_map(BPF_SCHEDULE_STATE_MAP_NAME);
+    let res = match state_fd {
+        Ok(state_fd) => stream_schedule(steps_fd, state_fd, steps.into_iter()),
+        Err(err) => Err(err),
+    };
+    libc::close(steps_fd);
+    if let Ok(state_fd) = state_fd {
+        libc::close(state_fd);
+    }
+    res
+}
+
+unsafe fn stream_schedule(
+    steps_fd: c_int,
+    state_fd: c_int,
+    mut steps: impl Iterator<Item = ScheduleStep>,
+) -> Result<(), BpfError> {
+    // indices carry on from the last schedule, so no CPU's cursor points into the new one
+    let last = lookup_elem::<KeymashSchedule>(state_fd, 0)?;
+    let mut state = KeymashSchedule {
+        start_ns: monotonic_ns(),
+        tail: last.head,
+        head: last.head,
+    };
+    // the times of the steps in the ring, oldest first
+    let mut queued: VecDeque<u64> = VecDeque::with_capacity(SCHEDULE_STEPS);
+    let mut exhausted = false;
+    let slack = SCHEDULE_SLACK.as_nanos() as u64;
+
+    loop {
+        // a step can go once the one after it took effect
+        let now = monotonic_ns() - state.start_ns;
+        while queued.len() > 1 && queued[1] + slack <= now {
+            queued.pop_front();
+            state.tail += 1;
+        }
+
+        let free = SCHEDULE_STEPS - queued.len();
+        if !exhausted && (free >= SCHEDULE_CHUNK || queued.is_empty()) {
+            let chunk: Vec<ScheduleStep> = steps.by_ref().take(free).collect();
+            exhausted = chunk.len() < free;
+            let keys: Vec<u32> = (state.head..state.head + chunk.len() as u64)
+                .map(|i| (i % SCHEDULE_STEPS as u64) as u32)
+                .collect();
+            if !chunk.is_empty() {
+                update_batch(steps_fd, &keys, &chunk)?;
+            }
+            queued.extend(chunk.iter().map(|step| step.at_ns));
+            state.head += chunk.len() as u64;
+        }
+        // the steps are in place before the range that covers them is published
+        update_elem(state_fd, &0u32 as *const u32 as *const c_void, &state as *const KeymashSchedule as *const c_void)?;
+
+        let sleep_until = |at: u64| {
+            std::thread::sleep(Duration::from_nanos(at.saturating_sub(monotonic_ns() - state.start_ns)));
+        };
+        if exhausted && queued.len() <= 1 {
+            if let Some(&last) = queued.front() {
+                sleep_until(last);
+            }
+            return Ok(());
+        }
+        // until a chunk's worth of steps can go, or all but the last
+        sleep_until(queued[SCHEDULE_CHUNK.min(queued.len() - 1)] + slack);
+    }
+}
+
+/// End the schedule started by [`play_schedule`]; the published config applies again.
+pub unsafe fn stop_schedule() -> Result<(), BpfError> {
+    let state_fd = open_map(BPF_SCHEDULE_STATE_MAP_NAME)?;
+    let res = lookup_elem::<KeymashSchedule>(state_fd, 0).and_then(|state| {
+        let state = KeymashSchedule { tail: state.head, ..state };
+        update_elem(state_fd, &0u32 as *const u32 as *const c_void, &state as *const KeymashSchedule as *const c_void)
+    });
+    libc::close(state_fd);
+    res
+}
+
+/// Parses a network trace for [`play_schedule`], one step per line, as it is read: whitespace
+/// separated `<time s> <loss 0..1> <delay ms> <jitter ms> <rate bytes/s>`, with a rate of 0 for
+/// no shaping, and anything after a `#` ignored. Shaping allows bursts of 10 ms of the rate.
+pub fn read_trace(reader: impl BufRead) -> impl Iterator<Item = io::Result<ScheduleStep>> {
+    reader.lines().enumerate().filter_map(|(i, line)| {
+        line.and_then(|line| {
+            parse_trace_line(&line)
+                .map_err(|msg| io::Error::new(io::ErrorKind::InvalidData, format!("line {}: {msg}", i + 1)))
+        })
+        .transpose()
+    })
+}
+
+/// One line of [`read_trace`], or `None` for a blank or comment line.
+fn parse_trace_line(line: &str) -> Result<Option<ScheduleStep>, String> {
+    let line = line.split('#').next().unwrap();
+    let fields: Vec<&str> = line.split_whitespace().collect();
+    if fields.is_empty() {
+        return Ok(None);
+    }
+    let &[at, loss, delay_ms, jitter_ms, rate] = fields.as_slice() else {
+        return Err(format!(
+            "expected <time s> <loss> <delay ms> <jitter ms> <rate bytes/s>, got {} fields",
+            fields.len()
+        ));
+    };
+
+    let number = |name: &str, field: &str| -> Result<f64, String> {
+        field.parse::<f64>().map_err(|_| format!("{name} {field:?} is not a number"))
+    };
+    let duration = |name: &str, field: &str, unit: f64| -> Result<Duration, String> {
+        Duration::try_from_secs_f64(number(name, field)? * unit)
+            .map_err(|_| format!("{name} {field:?} is not a finite, non-negative duration"))
+    };
+    let at = duration("time", at, 1.0)?;
+    let delay = duration("delay", delay_ms, 1e-3)?;
+    let jitter = duration("jitter", jitter_ms, 1e-3)?;
+    let loss = match number("loss", loss)? {
+        p if (0.0..=1.0).contains(&p) => p,
+        _ => return Err(format!("loss {loss:?} is not within 0..1")),
+    };
+    let rate = match number("rate", rate)? {
+        r if (0.0..=u64::MAX as f64).contains(&r) => r as u64,
+        _ => return Err(format!("rate {rate:?} is not a non-negative number of bytes/s")),
+    };
+
+    Ok(Some(
+        ScheduleStep::new(at, probability_to_threshold(loss))
+            .with_delay(delay, jitter)
+            .with_rate_limit(rate, (rate / 100).clamp(1514, u32::MAX as u64) as u32),
+    ))
+}
+
+/// Stages of the tc classifier pipeline. Mirrors `enum keymash_stage` in `bpf/bpf.c`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Stage {
+    /// Random loss with the configured [`DropModel`].
+    Drop,
+    /// Token bucket shaping, see [`KeymashConfig::with_rate_limit`].
+    Shape,
+    /// Egress delay and jitter, see [`KeymashConfig::with_delay`].
+    Delay,
+    /// Bit flips, see [`KeymashConfig::with_corruption`].
+    Corrupt,
+    /// Truncated datagrams, see [`KeymashConfig::with_truncation`].
+    Truncate,
+    /// Egress reordering, see [`KeymashConfig::with_reorder`].
+    Reorder,
+}
+
+impl Stage {
+    const COUNT: u32 = 6;
+    const ALL: [Stage; Self::COUNT as usize] = [
+        Stage::Drop,
+        Stage::Shape,
+        Stage::Delay,
+        Stage::Corrupt,
+        Stage::Truncate,
+        Stage::Reorder,
+    ];
+
+    fn program_name(self) -> &'static CStr {
+        match self {
+            Stage::Drop => c"keymash_stage_drop",
+            Stage::Shape => c"keymash_stage_shape",
+            Stage::Delay => c"keymash_stage_delay",
+            Stage::Corrupt => c"keymash_stage_corrupt",
+            Stage::Truncate => c"keymash_stage_truncate",
+            Stage::Reorder => c"keymash_stage_reorder",
+        }
+    }
+}
+
+/// A side of the interface that the tc classifier can be attached to with [`attach`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Direction {
+    Ingress,
+    Egress,
+}
+
+impl Direction {
+    fn program_name(self) -> &'static CStr {
+        match self {
+            Direction::Ingress => c"scream_bpf_ingress",
+            Direction::Egress => c"scream_bpf_egress",
+        }
+    }
+
+    fn attach_type(self) -> libbpf_sys::bpf_attach_type {
+        match self {
+            Direction::Ingress => BPF_TCX_INGRESS,
+            Direction::Egress => BPF_TCX_EGRESS,
+        }
+    }
+}
+
+/// Opens `obj_path`, or the object built into this binary if `None`. Its maps are pinned where tc
+/// pins them, and reused from there if they exist.
+unsafe fn open_object(obj_path: Option<&CStr>) -> Result<*mut bpf_object, BpfError> {
+    let mut opts: bpf_object_open_opts = std::mem::zeroed();
+    opts.sz = size_of::<bpf_object_open_opts>() as _;
+    opts.pin_root_path = BPF_PIN_ROOT.as_ptr();
+
+    let obj = match obj_path {
+        Some(path) if libc::access(path.as_ptr(), libc::R_OK) != 0 => {
+            let err = *libc::__errno_location();
+            log::error!(
+                "Cannot read BPF object {path:?} ({}); build it with clang as in bpf/README.md, or point KEYMASH_BPF_OBJECT at it",
+                io::Error::from_raw_os_error(err)
+            );
+            return Err(BpfError::LoadObject(-err));
+        }
+        Some(path) => libbpf_sys::bpf_object__open_file(path.as_ptr(), &opts),
+        None if BPF_OBJECT.is_empty() => {
+            log::error!("No BPF object was built into this binary; build it with the embed-bpf feature");
+            return Err(BpfError::LoadObject(-libc::ENOENT));
+        }
+        None => libbpf_sys::bpf_object__open_mem(
+            BPF_OBJECT.as_ptr() as *const c_void,
+            BPF_OBJECT.len() as _,
+            &opts,
+        ),
+    };
+    if obj.is_null() {
+        let err = *libc::__errno_location();
+        log::error!("Failed to open BPF object {obj_path:?}: {}", err);
+        return Err(BpfError::LoadObject(err));
+    }
+    Ok(obj)
+}
+
+/// The stage programs of the tc classifier, loaded next to the entry programs.
+///
+/// The entry programs tail-call into `map_keymash_pipeline` slot by slot, so only the stages
+/// set with [`BpfPipeline::set_stages`] run; until then targeted packets pass untouched.
+pub struct BpfPipeline {
+    obj: *mut bpf_object,
+    pipeline_fd: c_int,
+}
+
+// The object is never touched outside of `&self` methods that only read it.
+unsafe impl Send for BpfPipeline {}
+
+/// Loads the stage programs from `obj_path` (usually [`bpf_object_path`]).
+///
+/// The maps are reused from where tc pinned them, so this has to run after `bpf/setup-tc.sh`,
+/// and `obj_path` should be the object tc attached: a build whose map layouts differ fails to
+/// load, but nothing else tells two builds apart. Until this runs and
+/// [`BpfPipeline::set_stages`] fills the pipeline, targeted packets pass unimpaired.
+pub unsafe fn load_pipeline(obj_path: &CStr) -> Result<BpfPipeline, BpfError> {
+    // tc already runs the entry programs; only load the stages
+    BpfPipeline::load(open_object(Some(obj_path))?, &[], false)
+}
+
+impl BpfPipeline {
+    /// Loads the stage programs of `obj`, plus the entry programs of `entries`. Takes ownership
+    /// of `obj`. With `fresh`, the entry programs get a `map_keymash_pipeline` of their own
+    /// instead of the pinned one; see [`BpfPipeline::pin`].
+    unsafe fn load(obj: *mut bpf_object, entries: &[Direction], fresh: bool) -> Result<Self, BpfError> {
+        let mut pipeline = BpfPipeline { obj, pipeline_fd: -1 };
+        let map = libbpf_sys::bpf_object__find_map_by_name(obj, c"map_keymash_pipeline".as_ptr());
+        if map.is_null() {
+            log::error!("BPF object has no map_keymash_pipeline");
+            return Err(BpfError::LoadObject(-libc::ENOENT));
+        }
+        if fresh {
+            libbpf_sys::bpf_map__set_pin_path(map, std::ptr::null());
+        }
+
+        let mut prog = libbpf_sys::bpf_object__next_program(obj, std::ptr::null_mut());
+        while !prog.is_null() {
+            libbpf_sys::bpf_program__set_autoload(prog, false);
+            prog = libbpf_sys::bpf_object__next_program(obj, prog);
+        }
+        // the section names mean nothing to libbpf, so the types have to be set explicitly
+        for stage in Stage::ALL {
+            let prog = pipeline.program(stage.program_name())?;
+            libbpf_sys::bpf_program__set_autoload(prog, true);
+            libbpf_sys::bpf_program__set_type(prog, BPF_PROG_TYPE_SCHED_CLS);
+        }
+        for &dir in entries {
+            let prog = pipeline.program(dir.program_name())?;
+            libbpf_sys::bpf_program__set_autoload(prog, true);
+            libbpf_sys::bpf_program__set_type(prog, BPF_PROG_TYPE_SCHED_CLS);
+            libbpf_sys::bpf_program__set_expected_attach_type(prog, dir.attach_type());
+        }
+
+        let res = libbpf_sys::bpf_object__load(obj);
+        if res != 0 {
+            log::error!("Failed to load BPF object: {}", res);
+            return Err(BpfError::LoadObject(res));
+        }
+        pipeline.pipeline_fd = if fresh {
+            libc::dup(libbpf_sys::bpf_map__fd(map))
+        } else {
+            open_map(BPF_PIPELINE_MAP_NAME)?
+        };
+        Ok(pipeline)
+    }
+
+    /// Pins the pipeline of a classifier loaded with `fresh` in place of the old one, so that
+    /// [`load_pipeline`] and `bpftool` find the one that is attached.
+    unsafe fn pin(&self) -> Result<(), BpfError> {
+        let map = libbpf_sys::bpf_object__find_map_by_name(self.obj, c"map_keymash_pipeline".as_ptr());
+        // the old classifier keeps its map for as long as it runs
+        if libc::unlink(BPF_PIPELINE_MAP_NAME.as_ptr()) != 0 && *libc::__errno_location() != libc::ENOENT {
+            let err = *libc::__errno_location();
+            log::error!("Failed to unpin {BPF_PIPELINE_MAP_NAME:?}: {}", err);
+            return Err(BpfError::LoadMap(-err));
+        }
+        let res = libbpf_sys::bpf_map__pin(map, BPF_PIPELINE_MAP_NAME.as_ptr());
+        if res != 0 {
+            log::error!("Failed to pin {BPF_PIPELINE_MAP_NAME:?}: {}", res);
+            return Err(BpfError::LoadMap(res));
+        }
+        Ok(())
+    }
+
+    fn program(&self, name: &CStr) -> Result<*mut bpf_program, BpfError> {
+        let prog = unsafe { libbpf_sys::bpf_object__find_program_by_name(self.obj, name.as_ptr()) };
+        if prog.is_null() {
+            log::error!("BPF object has no program {name:?}");
+            return Err(BpfError::LoadObject(-libc::ENOENT));
+        }
+        Ok(prog)
+    }
+
+    /// Run `stages`, in this order, on every targeted packet. Stages that are left out are
+    /// never called. Takes effect for the next packet.
+    pub fn set_stages(&self, stages: &[Stage]) -> Result<(), BpfError> {
+        assert!(stages.len() <= Stage::COUNT as usize, "more stages than pipeline slots");
+        for pos in 0..Stage::COUNT {
+            let key = &pos as *const u32 as *const c_void;
+            match stages.get(pos as usize) {
+                Some(&stage) => {
+                    let prog_fd = unsafe { libbpf_sys::bpf_program__fd(self.program(stage.program_name())?) };
+                    update_elem(self.pipeline_fd, key, &prog_fd as *const c_int as *const c_void)?;
+                }
+                None => unsafe {
+                    // an empty slot ends the pipeline
+                    let res = libbpf_sys::bpf_map_delete_elem(self.pipeline_fd, key);
+                    if res != 0 && res != -libc::ENOENT {
+                        log::error!("Failed to delete from BPF map: {}", res);
+                        return Err(BpfError::MapDelete(res));
+                    }
+                },
+            }
+        }
+        Ok(())
+    }
+}
+
+impl Drop for BpfPipeline {
+    fn drop(&mut self) {
+        // the programs stay loaded for as long as map_keymash_pipeline refers to them
+        unsafe {
+            if self.pipeline_fd >= 0 {
+                libc::close(self.pipeline_fd);
+            }
+            libbpf_sys::bpf_object__close(self.obj);
+        }
+    }
+}
+
+/// The tc classifier attached by [`attach`]. Dropping it detaches the classifier again.
+pub struct BpfAttachment {
+    links: Vec<(Direction, *mut bpf_link)>,
+    pipeline: BpfPipeline,
+}
+
+// Links are only touched when dropped.
+unsafe impl Send for BpfAttachment {}
+
+/// Attach the classifier built into this binary to `ifname` in `directions`, as a replacement
+/// for `bpf/setup-tc.sh`.
+///
+/// This uses tcx links (Linux 6.6+), so no qdisc is created and nothing is left behind when the
+/// attachment is dropped or the process exits. The maps are pinned where tc would pin them, so
+/// [`init`] and the other functions of this module work the same either way; the two ways of
+/// attaching must not be mixed on one interface.
+pub unsafe fn attach(ifname: &str, directions: &[Direction]) -> Result<BpfAttachment, BpfError> {
+    let Ok(c_ifname) = CString::new(ifname) else {
+        return Err(BpfError::Attach(-libc::EINVAL));
+    };
+    let ifindex = libc::if_nametoindex(c_ifname.as_ptr());
+    if ifindex == 0 {
+        let err = *libc::__errno_location();
+        log::error!("No network interface {ifname}: {}", err);
+        return Err(BpfError::Attach(err));
+    }
+    // libbpf only creates the last component of the pin path
+    if let Err(e) = std::fs::create_dir_all(BPF_PIN_ROOT.to_str().unwrap()) {
+        log::error!("Failed to create {BPF_PIN_ROOT:?}: {e}");
+        return Err(BpfError::LoadObject(-e.raw_os_error().unwrap_or(libc::EIO)));
+    }
+
+    let mut attachment = BpfAttachment {
+        links: Vec::with_capacity(directions.len()),
+        pipeline: BpfPipeline::load(open_object(None)?, directions, false)?,
+    };
+    for &dir in directions {
+        let prog = attachment.pipeline.program(dir.program_name())?;
+        let link = libbpf_sys::bpf_program__attach_tcx(prog, ifindex as c_int, std::ptr::null());
+        if link.is_null() {
+            let err = *libc::__errno_location();
+            log::error!("Failed to attach BPF program to {ifname} {dir:?}: {}", err);
+            return Err(BpfError::Attach(err));
+        }
+        attachment.links.push((dir, link));
+    }
+    Ok(attachment)
+}
+
+impl BpfAttachment {
+    /// The stages of the attached classifier, see [`BpfPipeline::set_stages`].
+    pub fn pipeline(&self) -> &BpfPipeline {
+        &self.pipeline
+    }
+
+    /// Swap in the classifier of `obj_path` (or the one built into this binary if `None`),
+    /// running `stages`, without detaching: the new classifier gets a stage pipeline of its own
+    /// and then each link is pointed at its entry program in one atomic update. A packet runs
+    /// either the old or the new classifier from start to finish, and none passes unfiltered.
+    ///
+    /// All other maps are reused from their pins, so the published config, profiles, flows,
+    /// counters and controller state carry over. A classifier whose maps changed layout fails to
+    /// load, and the old one stays attached.
+    pub unsafe fn replace(&mut self, obj_path: Option<&CStr>, stages: &[Stage]) -> Result<(), BpfError> {
+        let directions: Vec<Direction> = self.links.iter().map(|&(dir, _)| dir).collect();
+        let pipeline = BpfPipeline::load(open_object(obj_path)?, &directions, true)?;
+        // nothing runs the new stages before the links are swapped
+        pipeline.set_stages(stages)?;
+        for (i, &(dir, link)) in self.links.iter().enumerate() {
+            let res = libbpf_sys::bpf_link__update_program(link, pipeline.program(dir.program_name())?);
+            if res != 0 {
+                log::error!("Failed to swap the BPF program of {dir:?}: {}", res);
+                // so that both directions keep running the same classifier
+                for &(dir, link) in &self.links[..i] {
+                    libbpf_sys::bpf_link__update_program(link, self.pipeline.program(dir.program_name())?);
+                }
+                return Err(BpfError::Attach(res));
+            }
+        }
+        let res = pipeline.pin();
+        // the old classifier goes away once the last packet that runs it is done
+        self.pipeline = pipeline;
+        res
+    }
+}
+
+impl Drop for BpfAttachment {
+    fn drop(&mut self) {
+        for &(_, link) in &self.links {
+            unsafe {
+                libbpf_sys::bpf_link__destroy(link);
+            }
+        }
+    }
+}
+
+/// A sampled drop decision of the filter. Mirrors `struct keymash_event` in `bpf/bpf.c`.
+#[derive(Debug, Clone, Copy)]
+#[repr(C)]
+pub struct KeymashEvent {
+    /// `CLOCK_MONOTONIC` time of the decision.
+    pub tstamp_ns: u64,
+    /// Length of the packet, including L2 header.
+    pub len: u32,
+    /// The drop threshold the loss model applied to this packet.
+    pub threshold: u32,
+    /// Sequence number of the packet's [`crate::rtp::PacketHeader`], or 0 for non-UDP packets.
+    pub rtp_seq: u32,
+    dir: u8,
+    verdict: u8,
+    /// The port that matched a target flow.
+    pub port: u16,
+}
+
+impl KeymashEvent {
+    pub fn is_ingress(&self) -> bool {
+        self.dir as u32 == KEYMASH_DIR_INGRESS
+    }
+
+    pub fn is_dropped(&self) -> bool {
+        self.verdict as u32 == KEYMASH_VERDICT_DROP
+    }
+}
+
+// Ring buffer record header flags, from `include/uapi/linux/bpf.h`.
+const BPF_RINGBUF_BUSY_BIT: u32 = 1 << 31;
+const BPF_RINGBUF_DISCARD_BIT: u32 = 1 << 30;
+const BPF_RINGBUF_HDR_SZ: usize = 8;
+
+/// Zero-copy consumer of the filter's `map_keymash_events` ring buffer.
+///
+/// The ring is mapped into our address space, and events are handed out as references into it;
+/// nothing is copied and no syscall is made unless we have to wait for more events.
+/// The events to report are chosen with [`KeymashConfig::event_sample_every`].
+pub struct BpfEventStream {
+    map_fd: c_int,
+    page_size: usize,
+    /// The consumer position page, the only part of the ring we write to.
+    consumer: *mut c_void,
+    /// The producer position page, followed by the data pages mapped twice in a row,
+    /// so that records wrapping around the end of the ring are contiguous.
+    producer: *mut c_void,
+    data_len: usize,
+}
+
+// The mappings are only touched through &mut self.
+unsafe impl Send for BpfEventStream {}
+
+/// Maps the filter's event ring buffer for consumption.
+pub unsafe fn open_event_stream() -> Result<BpfEventStream, BpfError> {
+    let map_fd = open_map(BPF_EVENTS_MAP_NAME)?;
+
+    let mut info: bpf_map_info = std::mem::zeroed();
+    let mut info_len = size_of::<bpf_map_info>() as u32;
+    let res = bpf_map_get_info_by_fd(map_fd, &mut info, &mut info_len);
+    if res != 0 {
+        log::error!("Failed to query BPF map {BPF_EVENTS_MAP_NAME:?}: {}", res);
+        libc::close(map_fd);
+        return Err(BpfError::MapInfo(res));
+    }
+
+    let page_size = libc::sysconf(libc::_SC_PAGESIZE) as usize;
+    let data_len = info.max_entries as usize;
+
+    let consumer = libc::mmap(
+        std::ptr::null_mut(),
+        page_size,
+        libc::PROT_READ | libc::PROT_WRITE,
+        libc::MAP_SHARED,
+        map_fd,
+        0,
+    );
+    if consumer == libc::MAP_FAILED {
+        let err = *libc::__errno_location();
+        log::error!("Failed to mmap consumer page of {BPF_EVENTS_MAP_NAME:?}: {}", err);
+        libc::close(map_fd);
+        return Err(BpfError::MapMmap(err));
+    }
+
+    let producer = libc::mmap(
+        std::ptr::null_mut(),
+        page_size + 2 * data_len,
+        libc::PROT_READ,
+        libc::MAP_SHARED,
+        map_fd,
+        page_size as libc::off_t,
+    );
+    if producer == libc::MAP_FAILED {
+        let err = *libc::__errno_location();
+        log::error!("Failed to mmap producer pages of {BPF_EVENTS_MAP_NAME:?}: {}", err);
+        libc::munmap(consumer, page_size);
+        libc::close(map_fd);
+        return Err(BpfError::MapMmap(err));
+    }
+
+    Ok(BpfEventStream {
+        map_fd,
+        page_size,
+        consumer,
+        producer,
+        data_len,
+    })
+}
+
+impl BpfEventStream {
+    fn consumer_pos(&self) -> &AtomicUsize {
+        unsafe { &*(self.consumer as *const AtomicUsize) }
+    }
+
+    fn producer_pos(&self) -> &AtomicUsize {
+        unsafe { &*(self.producer as *const AtomicUsize) }
+    }
+
+    /// Calls `on_event` for every event that is ready, without blocking.
+    /// Returns the number of events consumed.
+    pub fn consume(&mut self, mut on_event: impl FnMut(&KeymashEvent)) -> usize {
+        let data = unsafe { (self.producer as *const u8).add(self.page_size) };
+        let mask = self.data_len - 1;
+        let mut consumed = 0;
+
+        let mut cons = self.consumer_pos().load(Ordering::Acquire);
+        loop {
+            let prod = self.producer_pos().load(Ordering::Acquire);
+            if cons >= prod {
+                break;
+            }
+
+            let hdr = unsafe { data.add(cons & mask) };
+            let len = unsafe { &*(hdr as *const AtomicU32) }.load(Ordering::Acquire);
+            if len & BPF_RINGBUF_BUSY_BIT != 0 {
+                // the producer has reserved but not yet submitted this record
+                break;
+            }
+
+            let sample_len = (len & !BPF_RINGBUF_DISCARD_BIT) as usize;
+            if len & BPF_RINGBUF_DISCARD_BIT == 0 && sample_len == size_of::<KeymashEvent>() {
+                // records are 8-byte aligned, which is enough for KeymashEvent
+                let event = unsafe { &*(hdr.add(BPF_RINGBUF_HDR_SZ) as *const KeymashEvent) };
+                on_event(event);
+                consumed += 1;
+            }
+
+            cons += (sample_len + BPF_RINGBUF_HDR_SZ).next_multiple_of(8);
+            // hand the space back to the producer
+            self.consumer_pos().store(cons, Ordering::Release);
+        }
+        consumed
+    }
+
+    /// Waits up to `timeout` for events to arrive, then consumes them like [`BpfEventStream::consume`].
+    pub fn poll(
+        &mut self,
+        timeout: Duration,
+        on_event: impl FnMut(&KeymashEvent),
+    ) -> Result<usize, BpfError> {
+        let cons = self.consumer_pos().load(Ordering::Acquire);
+        if cons >= self.producer_pos().load(Ordering::Acquire) {
+            let mut pfd = libc::pollfd {
+                fd: self.map_fd,
+                events: libc::POLLIN,
+                revents: 0,
+            };
+            let res = unsafe { libc::poll(&mut pfd, 1, timeout.as_millis().min(i32::MAX as u128) as c_int) };
+            if res < 0 {
+                let err = unsafe { *libc::__errno_location() };
+                if err != libc::EINTR {
+                    log::error!("Failed to poll BPF event stream: {}", err);
+                    return Err(BpfError::Poll(err));
+                }
+            }
+        }
+        Ok(self.consume(on_event))
+    }
+}
+
+impl Drop for BpfEventStream {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.producer, self.page_size + 2 * self.data_len);
+            libc::munmap(self.consumer, self.page_size);
+            libc::close(self.map_fd);
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn parse(trace: &str) -> Vec<Result<ScheduleStep, String>> {
+        read_trace(trace.as_bytes()).map(|step| step.map_err(|err| err.to_string())).collect()
+    }
+
+    #[test]
+    fn test_read_trace() {
+        let steps = parse("# time loss delay jitter rate\n\n0 0.5 10 2 0 # lossy\n   \n1.5 0 0 0 125000\n");
+        assert_eq!(
+            steps,
+            [
+                Ok(ScheduleStep::new(Duration::ZERO, probability_to_threshold(0.5))
+                    .with_delay(Duration::from_millis(10), Duration::from_millis(2))
+                    .with_rate_limit(0, 1514)),
+                Ok(ScheduleStep::new(Duration::from_millis(1500), 0).with_rate_limit(125000, 1514)),
+            ]
+        );
+    }
+
+    #[test]
+    fn test_read_trace_field_count() {
+        let steps = parse("0 0 0 0 0\n1 0 0 0\n2 0 0 0 0 0\n");
+        assert!(steps[0].is_ok());
+        assert!(steps[1].as_ref().is_err_and(|err| err.starts_with("line 2:") && err.ends_with("got 4 fields")));
+        assert!(steps[2].as_ref().is_err_and(|err| err.starts_with("line 3:") && err.ends_with("got 6 fields")));
+    }
+
+    #[test]
+    fn test_read_trace_bad_numbers() {
+        for line in [
+            "x 0 0 0 0",
+            "-1 0 0 0 0",
+            "nan 0 0 0 0",
+            "inf 0 0 0 0",
+            "0 -0.1 0 0 0",
+            "0 1.5 0 0 0",
+            "0 nan 0 0 0",
+            "0 0 -5 0 0",
+            "0 0 0 inf 0",
+            "0 0 0 0 -1",
+            "0 0 0 0 1e30",
+        ] {
+            let steps = parse(line);
+            assert_eq!(steps.len(), 1);
+            assert!(steps[0].as_ref().is_err_and(|err| err.starts_with("line 1:")), "{line:?} parsed as {steps:?}");
         }
     }
 }
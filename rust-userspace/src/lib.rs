@@ -8,8 +8,10 @@ use zerocopy::{FromBytes, Immutable, IntoBytes, KnownLayout};
 pub mod audio;
 pub mod bpf;
 pub mod rtp;
+pub mod telemetry;
 pub mod video;
 pub mod wpm;
+pub mod xsk;
 
 pub const VIDEO_WIDTH: u32 = 640;
 pub const VIDEO_HEIGHT: u32 = 480;
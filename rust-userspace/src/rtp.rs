@@ -19,10 +19,17 @@ use std::{
     mem::offset_of,
     net::UdpSocket,
     num::NonZero,
+    os::fd::AsRawFd,
     ops::{Deref, DerefMut},
-    sync::{Arc, Mutex, MutexGuard},
+    sync::{
+        atomic::{AtomicU32, AtomicU64, Ordering},
+        Arc, Mutex, MutexGuard,
+    },
+    time::Duration,
 };
 
+use crate::xsk::{self, XskSocket};
+
 use zerocopy::{byteorder::network_endian::U32, FromBytes, Unaligned};
 use zerocopy::{Immutable, IntoBytes, KnownLayout, TryFromBytes};
 
@@ -146,6 +153,31 @@ where
     }
 }
 
+/// Counters of an [`RtpCircularBuffer`], kept up to date as packets arrive and are consumed.
+/// They live outside the buffer's `Mutex`, so [`crate::telemetry`] reads them without
+/// contending with the receiver. See [`RtpReceiver::stats`].
+#[derive(Debug, Default)]
+pub struct ReceiverStats {
+    /// Packets written into the buffer.
+    pub received: AtomicU64,
+    /// Received packets with a lower sequence number than a packet received before them.
+    pub reordered: AtomicU64,
+    /// Packets discarded for arriving after their slot was consumed.
+    pub late: AtomicU64,
+    /// Packets received again while the first copy was still in the buffer.
+    pub duplicate: AtomicU64,
+    /// Packets pushed out of the buffer unread to make room for a packet too far ahead.
+    pub overrun: AtomicU64,
+    /// Slots consumed (or pushed out) without a packet in them.
+    pub missing: AtomicU64,
+    /// Packets in the buffer right now.
+    pub occupancy: AtomicU32,
+    /// The buffer's current [`RtpCircularBuffer::early_latest_span`].
+    pub span: AtomicU32,
+    /// Number of slots in the buffer, its `BUFFER_LENGTH`.
+    pub capacity: usize,
+}
+
 /// A circular buffer of RTP packets.
 /// Index into this buffer with a sequence number to get a packet.
 /// `SLOT_SIZE` is the size of the payload data in bytes. This size is exclusive of packet metadata.
@@ -164,7 +196,11 @@ pub struct RtpCircularBuffer<
     /// This can relied on as a hint for how full the buffer is. (i.e. how ahead is the latest received packet?)
     /// External users can fetch this through [`RtpCircularBuffer::early_latest_span`].
     early_latest_span: u32,
+    /// The sequence number of the latest packet received, to tell reordered packets apart.
+    latest_seq: u32,
     buf: Box<[MaybeInitPacket<Payload, AlignPayloadTo, SLOT_SIZE>; BUFFER_LENGTH]>,
+    /// Shared with [`RtpReceiver::stats`].
+    stats: Arc<ReceiverStats>,
 }
 
 /// A packet that has been received and is ready to be consumed.
@@ -223,13 +259,20 @@ where
     fn drop(&mut self) {
         let rtp_receiver = &mut self.0;
 
-        rtp_receiver
+        let consumed = rtp_receiver
             .get_mut(rtp_receiver.earliest_seq)
             .unwrap()
-            .recv_size = None;
+            .recv_size
+            .take();
+        if consumed.is_some() {
+            rtp_receiver.stats.occupancy.fetch_sub(1, Ordering::Relaxed);
+        } else {
+            rtp_receiver.stats.missing.fetch_add(1, Ordering::Relaxed);
+        }
         log::trace!("consumed seq {}", rtp_receiver.earliest_seq);
         rtp_receiver.earliest_seq = rtp_receiver.earliest_seq.wrapping_add(1);
         rtp_receiver.early_latest_span = rtp_receiver.early_latest_span.saturating_sub(1);
+        rtp_receiver.stats.span.store(rtp_receiver.early_latest_span, Ordering::Relaxed);
     }
 }
 
@@ -253,11 +296,13 @@ where
         }
     }
 
-    fn new() -> Self {
+    fn new(stats: Arc<ReceiverStats>) -> Self {
         RtpCircularBuffer {
             earliest_seq: 0,
             early_latest_span: 0,
+            latest_seq: 0,
             buf: Box::new([const { Self::generate_default_packet() }; BUFFER_LENGTH]),
+            stats,
         }
     }
 
@@ -298,6 +343,68 @@ where
         }
     }
 
+    /// Makes room for a received packet with `seq_num` and returns the slot to write it to, or
+    /// None if the packet is too early/late to be accepted and should be discarded.
+    fn accept_slot(
+        &mut self,
+        seq_num: u32,
+    ) -> Option<&mut MaybeInitPacket<Payload, AlignPayloadTo, SLOT_SIZE>> {
+        // The received packet is allowed a place if its sequence number is larger than the earliest packet
+        // by u32::MAX / 2. (If more, this is probably a late packet and we discard it.)
+        if seq_num.wrapping_sub(self.earliest_seq) >= u32::MAX / 2 {
+            log::debug!(
+                "dropping seq_num {} for being too early/late; accepted range is {}-{}",
+                seq_num,
+                self.earliest_seq,
+                self.earliest_seq + self.buf.len() as u32
+            );
+            self.stats.late.fetch_add(1, Ordering::Relaxed);
+            return None;
+        }
+
+        // If this packet will need to overwrite old existing packets.
+        if seq_num.wrapping_sub(self.earliest_seq) as usize >= self.buf.len() {
+            log::debug!(
+                "received an advanced packet with seq {}; dropping packets from {} to {}",
+                seq_num,
+                self.earliest_seq,
+                seq_num.wrapping_sub(self.buf.len() as u32)
+            );
+            while seq_num.wrapping_sub(self.earliest_seq) as usize >= self.buf.len() {
+                // Drop old packets until we can fit this new one.
+                if self.get(self.earliest_seq).is_some_and(|p| p.is_init()) {
+                    self.stats.overrun.fetch_add(1, Ordering::Relaxed);
+                }
+                self.consume_earliest_packet();
+            }
+        }
+
+        // check whether we can update early_latest_span
+        self.early_latest_span = u32::max(
+            self.early_latest_span,
+            seq_num.wrapping_sub(self.earliest_seq),
+        );
+        self.stats.span.store(self.early_latest_span, Ordering::Relaxed);
+
+        if (seq_num.wrapping_sub(self.latest_seq) as i32) < 0 {
+            self.stats.reordered.fetch_add(1, Ordering::Relaxed);
+        } else {
+            self.latest_seq = seq_num;
+        }
+        self.stats.received.fetch_add(1, Ordering::Relaxed);
+
+        if self.get(seq_num).is_some_and(|p| p.is_init()) {
+            self.stats.duplicate.fetch_add(1, Ordering::Relaxed);
+        } else {
+            self.stats.occupancy.fetch_add(1, Ordering::Relaxed);
+        }
+
+        Some(
+            self.get_mut(seq_num)
+                .expect("Circular buffer should have space for packet."),
+        )
+    }
+
     /// See [`RtpCircularBuffer::get`].
     fn get_mut(
         &mut self,
@@ -341,6 +448,8 @@ pub struct RtpSender<
     seq_num: u32,
     /// A correctly aligned scratch buffer for writing packet data to.
     scratch: AlignedPacketBytes<Payload, AlignPayloadTo, SLOT_SIZE>,
+    /// Packets waiting to go out in one UDP GSO send; see [`RtpSender::with_gso`].
+    gso: Option<GsoBatch>,
 }
 
 impl<
@@ -363,6 +472,32 @@ where
                 _align: [],
                 inner: [0u8; size_of_packet::<[u8; SLOT_SIZE]>()],
             },
+            gso: None,
+        }
+    }
+
+    /// Batch up to `max_segments` packets into one `sendmsg` with `UDP_SEGMENT`, which the kernel
+    /// (or the NIC) splits back into one datagram per packet. Each packet keeps its own header
+    /// and sequence number, so the receiver cannot tell the difference; the tc filter sees the
+    /// batch as one skb and counts it as `gso_segs` packets (see `bpf::DirectionStats`).
+    ///
+    /// A batch holds packets of one size, plus at most one shorter packet at the end, so it goes
+    /// out early when the packet sizes vary. Packets sit in the batch until it is full or
+    /// [`RtpSender::flush`] is called.
+    pub fn with_gso(mut self, max_segments: usize) -> Self {
+        self.gso = (max_segments > 1).then(|| GsoBatch {
+            buf: Vec::with_capacity(GsoBatch::MAX_BYTES),
+            segment_size: 0,
+            segments: 0,
+            max_segments: max_segments.min(GsoBatch::MAX_SEGMENTS),
+        });
+        self
+    }
+
+    /// Send the packets batched so far. Does nothing without [`RtpSender::with_gso`].
+    pub fn flush(&mut self) {
+        if let Some(gso) = &mut self.gso {
+            gso.flush(&self.sock);
         }
     }
 
@@ -392,13 +527,102 @@ where
         let mem = &mut packet[packet_start_offset..];
         let payload_len = fill(mem);
         
-        super::udp_send(&self.sock, &packet[..packet_start_offset + payload_len]);
+        match &mut self.gso {
+            Some(gso) => gso.push(&self.sock, &packet[..packet_start_offset + payload_len]),
+            None => super::udp_send(&self.sock, &packet[..packet_start_offset + payload_len]),
+        }
         log::trace!("sent seq: {} ({} bytes)", self.seq_num, packet_start_offset + payload_len);
         
         self.seq_num = self.seq_num.wrapping_add(1);
     }
 }
 
+impl<
+        Payload: TryFromBytes + IntoBytes + Immutable + KnownLayout + ?Sized,
+        AlignPayloadTo: TryFromBytes + IntoBytes + KnownLayout + Immutable,
+        const SLOT_SIZE: usize,
+    > Drop for RtpSender<Payload, AlignPayloadTo, SLOT_SIZE>
+where
+    [(); size_of_packet::<[u8; SLOT_SIZE]>()]: Sized,
+{
+    fn drop(&mut self) {
+        self.flush();
+    }
+}
+
+/// Datagrams of `segment_size` bytes (the last one may be shorter), back to back.
+struct GsoBatch {
+    buf: Vec<u8>,
+    segment_size: usize,
+    segments: usize,
+    max_segments: usize,
+}
+
+impl GsoBatch {
+    /// `UDP_MAX_SEGMENTS` of the kernel.
+    const MAX_SEGMENTS: usize = 64;
+    /// The largest UDP payload over IPv4.
+    const MAX_BYTES: usize = 65507;
+
+    fn push(&mut self, sock: &UdpSocket, datagram: &[u8]) {
+        if self.segments > 0
+            && (datagram.len() > self.segment_size || self.buf.len() + datagram.len() > Self::MAX_BYTES)
+        {
+            self.flush(sock);
+        }
+        if self.segments == 0 {
+            self.segment_size = datagram.len();
+        }
+        self.buf.extend_from_slice(datagram);
+        self.segments += 1;
+        // a short datagram can only be the last segment
+        if datagram.len() < self.segment_size || self.segments == self.max_segments {
+            self.flush(sock);
+        }
+    }
+
+    fn flush(&mut self, sock: &UdpSocket) {
+        match self.segments {
+            0 => return,
+            1 => super::udp_send(sock, &self.buf),
+            _ => unsafe { self.send_segmented(sock) },
+        }
+        self.buf.clear();
+        self.segments = 0;
+    }
+
+    unsafe fn send_segmented(&self, sock: &UdpSocket) {
+        let mut iov = libc::iovec {
+            iov_base: self.buf.as_ptr() as *mut libc::c_void,
+            iov_len: self.buf.len(),
+        };
+        // room for one cmsghdr carrying a u16, aligned like cmsghdr
+        let mut control = [0u64; 4];
+        let mut msg: libc::msghdr = std::mem::zeroed();
+        msg.msg_iov = &mut iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+        msg.msg_controllen = libc::CMSG_SPACE(size_of::<u16>() as u32) as _;
+
+        let cmsg = libc::CMSG_FIRSTHDR(&msg);
+        (*cmsg).cmsg_level = libc::SOL_UDP;
+        (*cmsg).cmsg_type = libc::UDP_SEGMENT;
+        (*cmsg).cmsg_len = libc::CMSG_LEN(size_of::<u16>() as u32) as _;
+        std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut u16, self.segment_size as u16);
+
+        // the socket is connected, so no msg_name
+        if libc::sendmsg(sock.as_raw_fd(), &msg, 0) < 0 {
+            log::error!(
+                "Error sending {} segments from {:?} -> {:?}: {}",
+                self.segments,
+                sock.peer_addr(),
+                sock.local_addr(),
+                std::io::Error::last_os_error()
+            );
+        }
+    }
+}
+
 /// Implementation for Payloads that can be interpreted from the raw byte buffer without further validation.
 /// This enables creating a &mut Payload from the internal byte buffer.
 
@@ -434,6 +658,7 @@ pub struct RtpReceiver<
     [(); size_of_packet::<[u8; SLOT_SIZE]>()]: Sized,
 {
     rtp_circular_buffer: Arc<Mutex<RtpCircularBuffer<Payload, AlignPayloadTo, SLOT_SIZE, BUFFER_LENGTH>>>,
+    stats: Arc<ReceiverStats>,
 }
 
 /// An RTP receiver that recieves packets over the network, specialized for a `Sized` payload.
@@ -472,7 +697,8 @@ where
 {
     /// Launches listener thread that recieves packets and stores them in a buffer.
     pub fn new(sock: UdpSocket) -> Self {
-        let rtp_circular_buffer = Arc::new(Mutex::new(RtpCircularBuffer::new()));
+        let stats = Arc::new(ReceiverStats { capacity: BUFFER_LENGTH, ..Default::default() });
+        let rtp_circular_buffer = Arc::new(Mutex::new(RtpCircularBuffer::new(stats.clone())));
 
         let cloned_rtp_circular_buffer = rtp_circular_buffer.clone();
         std::thread::spawn(move || {
@@ -481,6 +707,23 @@ where
 
         RtpReceiver {
             rtp_circular_buffer,
+            stats,
+        }
+    }
+
+    /// Like [`RtpReceiver::new`], but receives from an AF_XDP socket, see [`crate::xsk`].
+    pub fn new_xsk(xsk: XskSocket) -> Self {
+        let stats = Arc::new(ReceiverStats { capacity: BUFFER_LENGTH, ..Default::default() });
+        let rtp_circular_buffer = Arc::new(Mutex::new(RtpCircularBuffer::new(stats.clone())));
+
+        let cloned_rtp_circular_buffer = rtp_circular_buffer.clone();
+        std::thread::spawn(move || {
+            xsk_accept_thread(xsk, cloned_rtp_circular_buffer);
+        });
+
+        RtpReceiver {
+            rtp_circular_buffer,
+            stats,
         }
     }
 
@@ -490,6 +733,11 @@ where
     ) -> MutexGuard<'_, RtpCircularBuffer<Payload, AlignPayloadTo, SLOT_SIZE, BUFFER_LENGTH>> {
         self.rtp_circular_buffer.lock().unwrap()
     }
+
+    /// The buffer's counters, readable from any thread without locking it.
+    pub fn stats(&self) -> Arc<ReceiverStats> {
+        self.stats.clone()
+    }
 }
 
 fn accept_thread<
@@ -518,39 +766,12 @@ fn accept_thread<
         let seq_num: u32 = PacketHeader::ref_from_bytes(&seq_num_buffer).unwrap().sequence_number.into();
 
         // If the received packet has a place in the buffer, write the packet to the correct slot.
-        // The received packet is allowed a place if its sequence number is larger than the earliest packet
-        // by u32::MAX / 2. (If more, this is probably a late packet and we discard it.)
-
-        if (seq_num.wrapping_sub(state.earliest_seq)) < u32::MAX / 2 {
-            // If this packet will need to overwrite old existing packets.
-            if seq_num.wrapping_sub(state.earliest_seq) as usize >= state.buf.len() {
-                log::debug!(
-                    "received an advanced packet with seq {}; dropping packets from {} to {}",
-                    seq_num,
-                    state.earliest_seq,
-                    seq_num.wrapping_sub(state.buf.len() as u32)
-                );
-                while seq_num.wrapping_sub(state.earliest_seq) as usize >= state.buf.len() {
-                    // Drop old packets until we can fit this new one.
-                    state.consume_earliest_packet();
-                }
-            }
-
-            // check whether we can update early_latest_span
-            state.early_latest_span = u32::max(
-                state.early_latest_span,
-                seq_num.wrapping_sub(state.earliest_seq),
-            );
-
-            // Receive packet into the correct slot.
-            let MaybeInitPacket {
-                recv_size: init,
-                packet,
-                ..
-            } = state
-                .get_mut(seq_num)
-                .expect("Circular buffer should have space for packet.");
-
+        if let Some(MaybeInitPacket {
+            recv_size: init,
+            packet,
+            ..
+        }) = state.accept_slot(seq_num)
+        {
             let len = sock.recv(packet).unwrap();
             *init = Some(NonZero::new(len).expect("Packet should have non-zero length."));
 
@@ -565,15 +786,238 @@ fn accept_thread<
             }
         } else {
             // Otherwise, discard the packet.
-
             let _ = sock.recv(&mut seq_num_buffer);
-            log::debug!(
-                "dropping seq_num {} for being too early/late; accepted range is {}-{}",
-                seq_num,
-                state.earliest_seq,
-                state.earliest_seq + state.buf.len() as u32
-            );
             continue;
         }
     }
 }
+
+/// [`accept_thread`] for an AF_XDP socket. The sequence number is read in place from the UMEM
+/// and the datagram is copied straight into its slot, a whole batch of packets per lock and
+/// without a syscall per packet.
+fn xsk_accept_thread<
+    Payload: TryFromBytes + IntoBytes + KnownLayout + Immutable + Debug + ?Sized,
+    AlignPayloadTo: TryFromBytes + IntoBytes + KnownLayout + Immutable,
+    const SLOT_SIZE: usize,
+    const BUFFER_LENGTH: usize,
+>(
+    mut xsk: XskSocket,
+    recv: Arc<Mutex<RtpCircularBuffer<Payload, AlignPayloadTo, SLOT_SIZE, BUFFER_LENGTH>>>,
+) where
+    [(); size_of_packet::<[u8; SLOT_SIZE]>()]: Sized,
+{
+    log::info!("Receiver started listening on an AF_XDP socket.");
+
+    loop {
+        // only block while the buffer is unlocked
+        if !xsk.wait(Duration::from_millis(100)).unwrap() {
+            continue;
+        }
+        let mut state = recv.lock().unwrap();
+
+        xsk.recv(|frame| {
+            // the filter only redirects UDP, but the frame is still attacker-controlled input
+            let Some(datagram) = xsk::udp_payload(frame) else {
+                return;
+            };
+            let Ok((header, _)) = PacketHeader::ref_from_prefix(datagram) else {
+                log::debug!("dropping a {} byte datagram without a header", datagram.len());
+                return;
+            };
+            let seq_num: u32 = header.sequence_number.into();
+
+            if let Some(MaybeInitPacket {
+                recv_size: init,
+                packet,
+                ..
+            }) = state.accept_slot(seq_num)
+            {
+                // like a UdpSocket, truncate datagrams that don't fit
+                let len = datagram.len().min(packet.len());
+                packet[..len].copy_from_slice(&datagram[..len]);
+                *init = Some(NonZero::new(len).expect("Packet should have non-zero length."));
+                log::trace!("received seq_num {seq_num} (len {len})");
+            }
+        });
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::net::Ipv4Addr;
+
+    use super::*;
+
+    type TestBuffer = RtpCircularBuffer<[u8], u8, 16, 4>;
+
+    fn test_buffer() -> TestBuffer {
+        RtpCircularBuffer::new(Arc::new(ReceiverStats { capacity: 4, ..Default::default() }))
+    }
+
+    /// Writes an empty packet with `seq_num` like [`accept_thread`] does; false if it was discarded.
+    fn receive(buf: &mut TestBuffer, seq_num: u32) -> bool {
+        match buf.accept_slot(seq_num) {
+            Some(slot) => {
+                slot.recv_size = NonZero::new(size_of::<PacketHeader>());
+                true
+            }
+            None => false,
+        }
+    }
+
+    /// `[received, reordered, late, duplicate, overrun, missing]`
+    fn counters(buf: &TestBuffer) -> [u64; 6] {
+        let stats = &buf.stats;
+        [&stats.received, &stats.reordered, &stats.late, &stats.duplicate, &stats.overrun, &stats.missing]
+            .map(|c| c.load(Ordering::Relaxed))
+    }
+
+    #[test]
+    fn test_stats_in_order() {
+        let mut buf = test_buffer();
+        for seq_num in 0..3 {
+            assert!(receive(&mut buf, seq_num));
+        }
+        assert_eq!(counters(&buf), [3, 0, 0, 0, 0, 0]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 3);
+        assert_eq!(buf.stats.span.load(Ordering::Relaxed), 2);
+
+        for _ in 0..3 {
+            buf.consume_earliest_packet();
+        }
+        assert_eq!(counters(&buf), [3, 0, 0, 0, 0, 0]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 0);
+        assert_eq!(buf.stats.span.load(Ordering::Relaxed), 0);
+    }
+
+    #[test]
+    fn test_stats_reordered_and_duplicate() {
+        let mut buf = test_buffer();
+        for seq_num in [0, 2, 1, 2] {
+            assert!(receive(&mut buf, seq_num));
+        }
+        // 1 arrived after 2; the second 2 is not reordered, only a duplicate
+        assert_eq!(counters(&buf), [4, 1, 0, 1, 0, 0]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 3);
+    }
+
+    #[test]
+    fn test_stats_late() {
+        let mut buf = test_buffer();
+        assert!(receive(&mut buf, 0));
+        assert!(receive(&mut buf, 1));
+        buf.consume_earliest_packet();
+        buf.consume_earliest_packet();
+
+        assert!(!receive(&mut buf, 1));
+        assert!(!receive(&mut buf, 0));
+        assert_eq!(counters(&buf), [2, 0, 2, 0, 0, 0]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 0);
+    }
+
+    #[test]
+    fn test_stats_overrun_and_missing() {
+        let mut buf = test_buffer();
+        for seq_num in [0, 1, 3] {
+            assert!(receive(&mut buf, seq_num));
+        }
+        // 6 pushes out 0 and 1 unread and the empty slot of 2
+        assert!(receive(&mut buf, 6));
+        assert_eq!(buf.earliest_seq(), 3);
+        assert_eq!(counters(&buf), [4, 0, 0, 0, 2, 1]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 2);
+        assert_eq!(buf.stats.span.load(Ordering::Relaxed), 3);
+
+        // 3 is played out, 4 and 5 never arrived
+        for _ in 0..3 {
+            buf.consume_earliest_packet();
+        }
+        assert_eq!(counters(&buf), [4, 0, 0, 0, 2, 3]);
+        assert_eq!(buf.stats.occupancy.load(Ordering::Relaxed), 1);
+        assert!(buf.peek_earliest_packet().is_some());
+    }
+
+    type TestSender = RtpSender<[u8], u8, 4096>;
+
+    /// A sender with [`RtpSender::with_gso`], connected to the returned non-blocking socket.
+    fn gso_sender(max_segments: usize) -> (TestSender, UdpSocket) {
+        let recv = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).unwrap();
+        recv.set_nonblocking(true).unwrap();
+        let sock = UdpSocket::bind((Ipv4Addr::LOCALHOST, 0)).unwrap();
+        sock.connect(recv.local_addr().unwrap()).unwrap();
+        (RtpSender::new(sock).with_gso(max_segments), recv)
+    }
+
+    /// Sends a packet with `len` bytes of payload, so a datagram of `len + 4` bytes.
+    fn send(sender: &mut TestSender, len: usize) {
+        sender.send_bytes(|mem| {
+            mem[..len].fill(0xab);
+            len
+        });
+    }
+
+    /// The lengths of the datagrams that arrived so far, as split by the kernel.
+    fn received(recv: &UdpSocket) -> Vec<usize> {
+        let mut buf = [0u8; 65536];
+        std::iter::from_fn(|| recv.recv(&mut buf).ok()).collect()
+    }
+
+    fn batched(sender: &TestSender) -> usize {
+        sender.gso.as_ref().unwrap().segments
+    }
+
+    #[test]
+    fn test_gso_max_segments() {
+        assert!(gso_sender(1).0.gso.is_none());
+        assert_eq!(gso_sender(1000).0.gso.as_ref().unwrap().max_segments, GsoBatch::MAX_SEGMENTS);
+
+        let (mut sender, recv) = gso_sender(4);
+        for _ in 0..10 {
+            send(&mut sender, 100);
+        }
+        // two full batches went out by themselves
+        assert_eq!(received(&recv), [104; 8]);
+        assert_eq!(batched(&sender), 2);
+
+        // as at the end of a frame
+        sender.flush();
+        assert_eq!(received(&recv), [104; 2]);
+        assert_eq!(batched(&sender), 0);
+        sender.flush();
+        assert!(received(&recv).is_empty());
+    }
+
+    #[test]
+    fn test_gso_size_changes() {
+        let (mut sender, recv) = gso_sender(16);
+        send(&mut sender, 100);
+        send(&mut sender, 100);
+        assert!(received(&recv).is_empty());
+
+        // a longer packet starts a batch of its own
+        send(&mut sender, 200);
+        assert_eq!(received(&recv), [104, 104]);
+        assert_eq!(batched(&sender), 1);
+
+        // a shorter one ends the batch
+        send(&mut sender, 200);
+        send(&mut sender, 50);
+        assert_eq!(received(&recv), [204, 204, 54]);
+        assert_eq!(batched(&sender), 0);
+    }
+
+    #[test]
+    fn test_gso_max_bytes() {
+        let (mut sender, recv) = gso_sender(64);
+        // 16 datagrams of 4004 bytes fit in GsoBatch::MAX_BYTES, 17 don't
+        for _ in 0..17 {
+            send(&mut sender, 4000);
+        }
+        assert_eq!(received(&recv), [4004; 16]);
+        assert_eq!(batched(&sender), 1);
+
+        // dropping the sender flushes it
+        drop(sender);
+        assert_eq!(received(&recv), [4004]);
+    }
+}
@@ -0,0 +1,381 @@
+//! Exports the filter's counters next to the receiver's, in the Prometheus text format, so the
+//! loss in the kernel, the late and missing packets in [`crate::rtp`] and the frame timings of
+//! `recv` can be read side by side, e.g. to tune the receive buffer length and the
+//! [`crate::wpm`] curves.
+//!
+//! [`spawn_exporter`] serves them over HTTP from a thread of its own. A scrape reads the BPF maps
+//! with a few batch lookups and the receiver's [`ReceiverStats`] with relaxed loads; it never
+//! takes the receive buffer's lock.
+
+use std::{
+    fmt::Write as _,
+    io::{self, Read, Write},
+    net::{TcpListener, ToSocketAddrs},
+    sync::{
+        atomic::{AtomicU32, AtomicU64, Ordering},
+        Arc,
+    },
+    thread::JoinHandle,
+    time::Duration,
+};
+
+use crate::{
+    bpf::{self, BpfHandle, DirectionStats, KeymashStats, LatencyHistogram, LATENCY_BUCKETS},
+    rtp::ReceiverStats,
+};
+
+/// What `recv` made of the received packets, updated once per pass of its frame loop.
+#[derive(Debug, Default)]
+pub struct PlayoutStats {
+    /// Frames drawn.
+    pub frames: AtomicU64,
+    /// Frames skipped, because the buffer already held packets of a later frame.
+    pub skipped: AtomicU64,
+    /// Passes that drew nothing and waited for more packets instead.
+    pub stalls: AtomicU64,
+    /// Passes of the frame loop.
+    pub passes: AtomicU64,
+    /// Time the passes took in total, in ns.
+    pub pass_time_ns: AtomicU64,
+    /// Passes that took longer than the frame interval.
+    pub overshoots: AtomicU64,
+    /// The typing speed, as the bits of an `f64`; see [`PlayoutStats::set_wpm`].
+    wpm: AtomicU64,
+    /// The drop threshold the typing speed calls for.
+    pub drop_threshold: AtomicU32,
+}
+
+impl PlayoutStats {
+    pub fn set_wpm(&self, wpm: f64) {
+        self.wpm.store(wpm.to_bits(), Ordering::Relaxed);
+    }
+
+    pub fn wpm(&self) -> f64 {
+        f64::from_bits(self.wpm.load(Ordering::Relaxed))
+    }
+
+    /// Count a pass of the frame loop that took `elapsed`, against a frame interval of `target`.
+    pub fn record_pass(&self, elapsed: Duration, target: Duration) {
+        self.passes.fetch_add(1, Ordering::Relaxed);
+        self.pass_time_ns.fetch_add(elapsed.as_nanos() as u64, Ordering::Relaxed);
+        if elapsed > target {
+            self.overshoots.fetch_add(1, Ordering::Relaxed);
+        }
+    }
+}
+
+/// Serves the metrics on `addr` (e.g. `0.0.0.0:9464`) until the process exits. The BPF metrics
+/// are left out if the filter's maps are not pinned when the exporter starts.
+pub fn spawn_exporter(
+    addr: impl ToSocketAddrs,
+    receiver: Arc<ReceiverStats>,
+    playout: Arc<PlayoutStats>,
+) -> io::Result<JoinHandle<()>> {
+    let listener = TcpListener::bind(addr)?;
+    log::info!("Serving metrics on {:?}", listener.local_addr());
+    Ok(std::thread::spawn(move || export_thread(listener, receiver, playout)))
+}
+
+/// Which of the filter's maps the exporter reads; the offload and non-instrumented builds of
+/// `bpf.c` lack some, and looking for them on every scrape would only flood the log.
+struct BpfSource {
+    handle: BpfHandle,
+    units: bool,
+    latency: bool,
+    bypassed: bool,
+}
+
+fn export_thread(listener: TcpListener, receiver: Arc<ReceiverStats>, playout: Arc<PlayoutStats>) {
+    let bpf = match unsafe { bpf::init() } {
+        Ok(handle) => Some(BpfSource {
+            units: handle.read_unit_stats().is_ok(),
+            latency: handle.read_latency().is_ok(),
+            bypassed: handle.read_bypassed().is_ok(),
+            handle,
+        }),
+        Err(err) => {
+            log::warn!("BPF maps not found ({err:?}); exporting receiver metrics only");
+            None
+        }
+    };
+
+    let mut body = String::new();
+    for stream in listener.incoming() {
+        let mut stream = match stream {
+            Ok(stream) => stream,
+            Err(err) => {
+                log::warn!("Failed to accept a metrics connection: {err}");
+                continue;
+            }
+        };
+        // any request gets the metrics, so only read it to be polite to the client
+        let _ = stream.set_read_timeout(Some(Duration::from_secs(1)));
+        let _ = stream.read(&mut [0u8; 1024]);
+
+        body.clear();
+        if let Some(bpf) = &bpf {
+            render_bpf(&mut body, bpf);
+        }
+        render_receiver(&mut body, &receiver);
+        render_playout(&mut body, &playout);
+
+        let res = write!(
+            stream,
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: {}\r\n\r\n{body}",
+            body.len()
+        );
+        if let Err(err) = res {
+            log::debug!("Failed to send metrics: {err}");
+        }
+    }
+}
+
+fn header(out: &mut String, name: &str, kind: &str, help: &str) {
+    let _ = writeln!(out, "# HELP {name} {help}\n# TYPE {name} {kind}");
+}
+
+/// The passed and dropped halves of each counter in [`DirectionStats`].
+const DIRECTION_COUNTERS: [(&str, &str, fn(&DirectionStats) -> [u64; 2]); 3] = [
+    ("packets_total", "Packets of targeted traffic, one per skb or XDP frame.", |d| {
+        [d.passed_packets, d.dropped_packets]
+    }),
+    ("segments_total", "Wire packets of targeted traffic, counting every GSO/GRO segment.", |d| {
+        [d.passed_segments, d.dropped_segments]
+    }),
+    ("bytes_total", "Bytes of targeted traffic.", |d| [d.passed_bytes, d.dropped_bytes]),
+];
+
+/// Writes `stats` under `prefix`, each entry with its own extra labels (ending in a comma).
+fn render_stats(out: &mut String, prefix: &str, stats: &[(String, KeymashStats)]) {
+    for (name, help, values) in DIRECTION_COUNTERS {
+        header(out, &format!("{prefix}_{name}"), "counter", help);
+        for (labels, stats) in stats {
+            for (dir, stats) in [("ingress", &stats.ingress), ("egress", &stats.egress)] {
+                let [passed, dropped] = values(stats);
+                let _ = writeln!(out, "{prefix}_{name}{{{labels}direction=\"{dir}\",verdict=\"pass\"}} {passed}");
+                let _ = writeln!(out, "{prefix}_{name}{{{labels}direction=\"{dir}\",verdict=\"drop\"}} {dropped}");
+            }
+        }
+    }
+}
+
+fn render_latency(out: &mut String, histogram: &LatencyHistogram) {
+    let name = "keymash_bpf_run_seconds";
+    header(out, name, "histogram", "Run time of the filter per packet.");
+    for (dir, buckets) in [("ingress", &histogram.ingress), ("egress", &histogram.egress)] {
+        let mut seen = 0;
+        for (i, count) in buckets.iter().enumerate().take(LATENCY_BUCKETS - 1) {
+            seen += count;
+            let le = (1u64 << (i + 1)) as f64 * 1e-9;
+            let _ = writeln!(out, "{name}_bucket{{direction=\"{dir}\",le=\"{le:e}\"}} {seen}");
+        }
+        seen += buckets[LATENCY_BUCKETS - 1];
+        let _ = writeln!(out, "{name}_bucket{{direction=\"{dir}\",le=\"+Inf\"}} {seen}");
+        let _ = writeln!(out, "{name}_count{{direction=\"{dir}\"}} {seen}");
+    }
+}
+
+fn render_bypassed(out: &mut String, bypassed: [u64; 2]) {
+    let name = "keymash_bpf_bypassed_packets_total";
+    header(out, name, "counter", "Packets passed unparsed while the filter was bypassed.");
+    for (dir, count) in [("ingress", bypassed[0]), ("egress", bypassed[1])] {
+        let _ = writeln!(out, "{name}{{direction=\"{dir}\"}} {count}");
+    }
+}
+
+fn render_bpf(out: &mut String, bpf: &BpfSource) {
+    match bpf.handle.read_stats() {
+        Ok(stats) => render_stats(out, "keymash_bpf", &[(String::new(), stats)]),
+        Err(err) => log::debug!("Skipping the BPF stats: {err:?}"),
+    }
+    if bpf.units {
+        match bpf.handle.read_unit_stats() {
+            Ok(units) => {
+                let units: Vec<_> = units
+                    .into_iter()
+                    .map(|(unit, stats)| (format!("unit=\"{unit}\","), stats))
+                    .collect();
+                render_stats(out, "keymash_bpf_unit", &units);
+            }
+            Err(err) => log::debug!("Skipping the BPF unit stats: {err:?}"),
+        }
+    }
+    if bpf.bypassed {
+        match bpf.handle.read_bypassed() {
+            Ok(bypassed) => render_bypassed(out, bypassed),
+            Err(err) => log::debug!("Skipping the BPF bypass counter: {err:?}"),
+        }
+    }
+    if bpf.latency {
+        match bpf.handle.read_latency() {
+            Ok(histogram) => render_latency(out, &histogram),
+            Err(err) => log::debug!("Skipping the BPF latency histogram: {err:?}"),
+        }
+    }
+}
+
+fn render_receiver(out: &mut String, stats: &ReceiverStats) {
+    let counters = [
+        ("received", "Packets written into the receive buffer.", &stats.received),
+        ("reordered", "Packets that arrived after a packet with a higher sequence number.", &stats.reordered),
+        ("late", "Packets discarded for arriving after their slot was played out.", &stats.late),
+        ("duplicate", "Packets that arrived again while still buffered.", &stats.duplicate),
+        ("overrun", "Buffered packets pushed out unread by a packet too far ahead.", &stats.overrun),
+        ("missing", "Slots played out or pushed out without a packet in them.", &stats.missing),
+    ];
+    for (name, help, value) in counters {
+        let name = format!("keymash_rtp_{name}_total");
+        header(out, &name, "counter", help);
+        let _ = writeln!(out, "{name} {}", value.load(Ordering::Relaxed));
+    }
+    let gauges = [
+        ("buffer_occupancy", "Packets in the receive buffer.", stats.occupancy.load(Ordering::Relaxed) as u64),
+        ("buffer_span", "Sequence numbers between the next packet to play out and the latest received.", stats.span.load(Ordering::Relaxed) as u64),
+        ("buffer_capacity", "Slots in the receive buffer.", stats.capacity as u64),
+    ];
+    for (name, help, value) in gauges {
+        let name = format!("keymash_rtp_{name}");
+        header(out, &name, "gauge", help);
+        let _ = writeln!(out, "{name} {value}");
+    }
+}
+
+fn render_playout(out: &mut String, stats: &PlayoutStats) {
+    let counters = [
+        ("frames", "Frames drawn.", &stats.frames),
+        ("skipped_frames", "Frames skipped for a later one.", &stats.skipped),
+        ("stalls", "Frame intervals spent waiting for packets.", &stats.stalls),
+        ("overshoots", "Frame intervals that took longer than the target frame rate allows.", &stats.overshoots),
+    ];
+    for (name, help, value) in counters {
+        let name = format!("keymash_playout_{name}_total");
+        header(out, &name, "counter", help);
+        let _ = writeln!(out, "{name} {}", value.load(Ordering::Relaxed));
+    }
+
+    let name = "keymash_playout_pass_seconds";
+    header(out, name, "summary", "Time to receive and draw a frame.");
+    let _ = writeln!(out, "{name}_sum {}", stats.pass_time_ns.load(Ordering::Relaxed) as f64 * 1e-9);
+    let _ = writeln!(out, "{name}_count {}", stats.passes.load(Ordering::Relaxed));
+
+    header(out, "keymash_wpm", "gauge", "Typing speed in words per minute.");
+    let _ = writeln!(out, "keymash_wpm {}", stats.wpm());
+    header(out, "keymash_drop_threshold", "gauge", "Drop threshold the typing speed calls for, out of 2^32.");
+    let _ = writeln!(out, "keymash_drop_threshold {}", stats.drop_threshold.load(Ordering::Relaxed));
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn lines(out: &str) -> Vec<&str> {
+        out.lines().filter(|line| !line.starts_with('#')).collect()
+    }
+
+    #[test]
+    fn test_render_receiver() {
+        let stats = ReceiverStats { capacity: 256, ..Default::default() };
+        stats.received.store(10, Ordering::Relaxed);
+        stats.late.store(2, Ordering::Relaxed);
+        stats.missing.store(3, Ordering::Relaxed);
+        stats.occupancy.store(7, Ordering::Relaxed);
+        stats.span.store(9, Ordering::Relaxed);
+
+        let mut out = String::new();
+        render_receiver(&mut out, &stats);
+        assert_eq!(
+            lines(&out),
+            [
+                "keymash_rtp_received_total 10",
+                "keymash_rtp_reordered_total 0",
+                "keymash_rtp_late_total 2",
+                "keymash_rtp_duplicate_total 0",
+                "keymash_rtp_overrun_total 0",
+                "keymash_rtp_missing_total 3",
+                "keymash_rtp_buffer_occupancy 7",
+                "keymash_rtp_buffer_span 9",
+                "keymash_rtp_buffer_capacity 256",
+            ]
+        );
+        assert!(out.contains("# TYPE keymash_rtp_late_total counter\n"));
+        assert!(out.contains("# TYPE keymash_rtp_buffer_span gauge\n"));
+    }
+
+    #[test]
+    fn test_render_stats() {
+        let stats = KeymashStats {
+            egress: DirectionStats {
+                passed_packets: 5,
+                passed_bytes: 5000,
+                passed_segments: 8,
+                dropped_packets: 1,
+                dropped_bytes: 1000,
+                dropped_segments: 2,
+            },
+            ..Default::default()
+        };
+
+        let mut out = String::new();
+        render_stats(&mut out, "keymash_bpf_unit", &[("unit=\"3\",".to_string(), stats)]);
+        let lines = lines(&out);
+        assert_eq!(lines.len(), 3 * 2 * 2);
+        assert!(lines.contains(&"keymash_bpf_unit_packets_total{unit=\"3\",direction=\"egress\",verdict=\"pass\"} 5"));
+        assert!(lines.contains(&"keymash_bpf_unit_segments_total{unit=\"3\",direction=\"egress\",verdict=\"drop\"} 2"));
+        assert!(lines.contains(&"keymash_bpf_unit_bytes_total{unit=\"3\",direction=\"ingress\",verdict=\"drop\"} 0"));
+        // one header per counter, not per label set
+        assert_eq!(out.matches("# TYPE keymash_bpf_unit_bytes_total counter\n").count(), 1);
+    }
+
+    #[test]
+    fn test_render_bypassed() {
+        let mut out = String::new();
+        render_bypassed(&mut out, [3, 5]);
+        assert_eq!(
+            lines(&out),
+            [
+                "keymash_bpf_bypassed_packets_total{direction=\"ingress\"} 3",
+                "keymash_bpf_bypassed_packets_total{direction=\"egress\"} 5",
+            ]
+        );
+    }
+
+    #[test]
+    fn test_render_latency() {
+        let mut histogram = LatencyHistogram { ingress: [0; LATENCY_BUCKETS], egress: [0; LATENCY_BUCKETS] };
+        histogram.egress[0] = 1;
+        histogram.egress[2] = 4;
+        histogram.egress[LATENCY_BUCKETS - 1] = 1;
+
+        let mut out = String::new();
+        render_latency(&mut out, &histogram);
+        let lines = lines(&out);
+        // the buckets are cumulative, up to 2^i ns
+        assert!(lines.contains(&"keymash_bpf_run_seconds_bucket{direction=\"egress\",le=\"2e-9\"} 1"));
+        assert!(lines.contains(&"keymash_bpf_run_seconds_bucket{direction=\"egress\",le=\"4e-9\"} 1"));
+        assert!(lines.contains(&"keymash_bpf_run_seconds_bucket{direction=\"egress\",le=\"8e-9\"} 5"));
+        assert!(lines.contains(&"keymash_bpf_run_seconds_bucket{direction=\"egress\",le=\"+Inf\"} 6"));
+        assert!(lines.contains(&"keymash_bpf_run_seconds_count{direction=\"egress\"} 6"));
+        assert!(lines.contains(&"keymash_bpf_run_seconds_count{direction=\"ingress\"} 0"));
+        assert_eq!(lines.len(), 2 * (LATENCY_BUCKETS + 1));
+    }
+
+    #[test]
+    fn test_render_playout() {
+        let stats = PlayoutStats::default();
+        stats.frames.store(30, Ordering::Relaxed);
+        stats.record_pass(Duration::from_millis(20), Duration::from_millis(33));
+        stats.record_pass(Duration::from_millis(40), Duration::from_millis(33));
+        stats.set_wpm(42.5);
+
+        let mut out = String::new();
+        render_playout(&mut out, &stats);
+        let lines = lines(&out);
+        assert!(lines.contains(&"keymash_playout_frames_total 30"));
+        assert!(lines.contains(&"keymash_playout_overshoots_total 1"));
+        assert!(lines.contains(&"keymash_playout_pass_seconds_count 2"));
+        let sum = lines.iter().find_map(|line| line.strip_prefix("keymash_playout_pass_seconds_sum "));
+        assert!((sum.unwrap().parse::<f64>().unwrap() - 0.06).abs() < 1e-9);
+        assert!(lines.contains(&"keymash_wpm 42.5"));
+        assert!(out.contains("# TYPE keymash_playout_pass_seconds summary\n"));
+    }
+}
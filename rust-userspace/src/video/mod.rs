@@ -297,7 +297,7 @@ fn dequantize_block(
     result
 }
 
-/// Range quality from 0.3 to 0.03. (Lower is better)
+/// Range quality from [`crate::wpm::WORST_JPEG_QUALITY`] to [`crate::wpm::BEST_JPEG_QUALITY`]. (Lower is better)
 pub fn quality_scaled_q_matrix(q_matrix: &[[f64; 8]; 8], quality: f64) -> [[f64; 8]; 8] {
     q_matrix.map(|row| row.map(|x| x * quality))
 }
@@ -514,6 +514,21 @@ mod test {
         assert_eq!(block.v, dequantized_block.v);
     }
 
+    #[test]
+    fn test_quality_is_a_quantizer_scale() {
+        use crate::wpm::{BEST_JPEG_QUALITY, WORST_JPEG_QUALITY};
+
+        let nonzero = |quality| {
+            let q_matrix = quality_scaled_q_matrix(&LUMINANCE_QUANTIZATION_TABLE, quality);
+            let quantized = quantize_block(&[[20.0; 8]; 8], &q_matrix);
+            quantized.iter().flatten().filter(|&&c| c != 0).count()
+        };
+        // a larger quality keeps fewer coefficients, so send.rs can coarsen a frame by scaling it up
+        assert_eq!(nonzero(BEST_JPEG_QUALITY), 64);
+        assert!(nonzero(0.3) <= nonzero(BEST_JPEG_QUALITY));
+        assert!(nonzero(WORST_JPEG_QUALITY) < nonzero(0.3));
+    }
+
     #[test]
     fn test_macroblock_compression() {
         simplelog::SimpleLogger::init(simplelog::LevelFilter::Trace, simplelog::Config::default())
@@ -36,8 +36,10 @@ pub fn wpm_to_sdl_color(wpm: f64, base_color: Color) -> Color {
     wpm_color
 }
 
-const WORST_JPEG_QUALITY: f64 = 1.0;
-const BEST_JPEG_QUALITY: f64 = 0.03;
+/// The coarsest quality the receiver asks for: the unscaled quantization tables.
+pub const WORST_JPEG_QUALITY: f64 = 1.0;
+/// The finest quality the receiver asks for.
+pub const BEST_JPEG_QUALITY: f64 = 0.03;
 
 pub fn wpm_to_jpeg_quality(wpm: f64) -> f64 {
     let clipped_wpm = wpm.min(WPM_SATURATION);
@@ -0,0 +1,374 @@
+//! The receive side of an AF_XDP socket. `scream_xdp_xsk` in `bpf/bpf.c` redirects the packets
+//! that survive impairment into it, and the driver writes them straight into memory shared with
+//! this process (the UMEM), so receiving needs no syscall per packet. See
+//! [`crate::rtp::RtpReceiver::new_xsk`].
+//!
+//! The UMEM is split into [`FRAME_SIZE`] frames. The process hands empty frames to the kernel
+//! through the fill ring, and gets them back, filled, through the RX ring.
+
+use std::{
+    ffi::{c_int, c_void, CString},
+    io,
+    sync::atomic::{AtomicU32, Ordering},
+    time::Duration,
+};
+
+use crate::bpf;
+
+/// Size of a UMEM frame; one packet per frame.
+pub const FRAME_SIZE: usize = 4096;
+/// Entries of the fill and RX rings, and the number of frames in the UMEM. The rings can then
+/// hold every frame at once, so returning a frame to the fill ring never has to wait.
+const RING_SIZE: u32 = 2048;
+
+/// A ring shared with the kernel; entries are `u64` frame addresses (fill) or `xdp_desc` (RX).
+struct Ring {
+    producer: *const AtomicU32,
+    consumer: *const AtomicU32,
+    flags: *const AtomicU32,
+    desc: *mut c_void,
+    mem: *mut c_void,
+    mem_len: usize,
+}
+
+impl Ring {
+    const UNMAPPED: Ring = Ring {
+        producer: std::ptr::null(),
+        consumer: std::ptr::null(),
+        flags: std::ptr::null(),
+        desc: std::ptr::null_mut(),
+        mem: std::ptr::null_mut(),
+        mem_len: 0,
+    };
+
+    unsafe fn map(fd: c_int, off: &libc::xdp_ring_offset, entry_size: usize, pgoff: u64) -> io::Result<Ring> {
+        let mem_len = off.desc as usize + RING_SIZE as usize * entry_size;
+        let mem = libc::mmap(
+            std::ptr::null_mut(),
+            mem_len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_SHARED | libc::MAP_POPULATE,
+            fd,
+            pgoff as libc::off_t,
+        );
+        if mem == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Ring {
+            producer: mem.add(off.producer as usize) as *const AtomicU32,
+            consumer: mem.add(off.consumer as usize) as *const AtomicU32,
+            flags: mem.add(off.flags as usize) as *const AtomicU32,
+            desc: mem.add(off.desc as usize),
+            mem,
+            mem_len,
+        })
+    }
+}
+
+impl Drop for Ring {
+    fn drop(&mut self) {
+        if !self.mem.is_null() {
+            unsafe {
+                libc::munmap(self.mem, self.mem_len);
+            }
+        }
+    }
+}
+
+/// An AF_XDP socket bound to one receive queue of an interface, receiving UDP `port`.
+pub struct XskSocket {
+    fd: c_int,
+    queue: u32,
+    port: u16,
+    umem: *mut u8,
+    fill: Ring,
+    rx: Ring,
+}
+
+// The rings are only touched through `&mut self`, and the UMEM is owned.
+unsafe impl Send for XskSocket {}
+
+impl XskSocket {
+    /// Creates a socket with its own UMEM on `queue` of `ifname` and registers it with the
+    /// filter for UDP `port`. `bpf.o` must be attached with `ip link set dev <ifname> xdpdrv obj
+    /// bpf.o sec xsk`, and the traffic steered to `queue` (e.g. with `ethtool -N`).
+    pub unsafe fn bind(ifname: &str, queue: u32, port: u16) -> io::Result<XskSocket> {
+        let ifname = CString::new(ifname).map_err(|_| io::Error::from(io::ErrorKind::InvalidInput))?;
+        let ifindex = libc::if_nametoindex(ifname.as_ptr());
+        if ifindex == 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        let umem_len = RING_SIZE as usize * FRAME_SIZE;
+        let umem = libc::mmap(
+            std::ptr::null_mut(),
+            umem_len,
+            libc::PROT_READ | libc::PROT_WRITE,
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_POPULATE,
+            -1,
+            0,
+        );
+        if umem == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        let fd = libc::socket(libc::AF_XDP, libc::SOCK_RAW | libc::SOCK_CLOEXEC, 0);
+        if fd < 0 {
+            let err = io::Error::last_os_error();
+            libc::munmap(umem, umem_len);
+            return Err(err);
+        }
+        // from here on, dropping the half-built socket cleans up
+        let mut xsk = XskSocket {
+            fd,
+            queue,
+            port,
+            umem: umem as *mut u8,
+            fill: Ring::UNMAPPED,
+            rx: Ring::UNMAPPED,
+        };
+
+        let mut reg: libc::xdp_umem_reg = std::mem::zeroed();
+        reg.addr = umem as u64;
+        reg.len = umem_len as u64;
+        reg.chunk_size = FRAME_SIZE as u32;
+        xsk.setsockopt(libc::XDP_UMEM_REG, &reg)?;
+        // the kernel insists on a completion ring, even though nothing is ever sent
+        xsk.setsockopt(libc::XDP_UMEM_FILL_RING, &RING_SIZE)?;
+        xsk.setsockopt(libc::XDP_UMEM_COMPLETION_RING, &RING_SIZE)?;
+        xsk.setsockopt(libc::XDP_RX_RING, &RING_SIZE)?;
+
+        let mut off: libc::xdp_mmap_offsets = std::mem::zeroed();
+        let mut off_len = size_of::<libc::xdp_mmap_offsets>() as libc::socklen_t;
+        if libc::getsockopt(fd, libc::SOL_XDP, libc::XDP_MMAP_OFFSETS, &mut off as *mut _ as *mut c_void, &mut off_len) != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        xsk.fill = Ring::map(fd, &off.fr, size_of::<u64>(), libc::XDP_UMEM_PGOFF_FILL_RING)?;
+        xsk.rx = Ring::map(fd, &off.rx, size_of::<libc::xdp_desc>(), libc::XDP_PGOFF_RX_RING as u64)?;
+
+        // hand every frame to the kernel
+        let fill_desc = xsk.fill.desc as *mut u64;
+        for i in 0..RING_SIZE {
+            *fill_desc.add(i as usize) = i as u64 * FRAME_SIZE as u64;
+        }
+        (*xsk.fill.producer).store(RING_SIZE, Ordering::Release);
+
+        // zero-copy if the driver supports it, copy mode otherwise
+        let mut addr: libc::sockaddr_xdp = std::mem::zeroed();
+        addr.sxdp_family = libc::AF_XDP as u16;
+        addr.sxdp_flags = libc::XDP_USE_NEED_WAKEUP;
+        addr.sxdp_ifindex = ifindex;
+        addr.sxdp_queue_id = queue;
+        if libc::bind(fd, &addr as *const _ as *const libc::sockaddr, size_of::<libc::sockaddr_xdp>() as libc::socklen_t) != 0 {
+            return Err(io::Error::last_os_error());
+        }
+
+        bpf::register_xsk(queue, fd, port).map_err(|err| io::Error::other(format!("{err:?}")))?;
+        log::info!("AF_XDP socket bound to queue {queue} of interface {ifindex} for port {port}");
+        Ok(xsk)
+    }
+
+    unsafe fn setsockopt<T>(&self, name: c_int, value: &T) -> io::Result<()> {
+        let res = libc::setsockopt(
+            self.fd,
+            libc::SOL_XDP,
+            name,
+            value as *const T as *const c_void,
+            size_of::<T>() as libc::socklen_t,
+        );
+        if res != 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    /// Number of received frames waiting in the RX ring.
+    fn rx_ready(&self) -> u32 {
+        unsafe {
+            let producer = (*self.rx.producer).load(Ordering::Acquire);
+            producer.wrapping_sub((*self.rx.consumer).load(Ordering::Relaxed))
+        }
+    }
+
+    /// Blocks until frames are ready or `timeout` passes. Returns whether frames are ready.
+    pub fn wait(&self, timeout: Duration) -> io::Result<bool> {
+        if self.rx_ready() > 0 {
+            return Ok(true);
+        }
+        let mut pfd = libc::pollfd { fd: self.fd, events: libc::POLLIN, revents: 0 };
+        let res = unsafe { libc::poll(&mut pfd, 1, timeout.as_millis().min(c_int::MAX as u128) as c_int) };
+        if res < 0 {
+            let err = io::Error::last_os_error();
+            if err.kind() != io::ErrorKind::Interrupted {
+                return Err(err);
+            }
+        }
+        Ok(self.rx_ready() > 0)
+    }
+
+    /// Calls `on_frame` with each received frame, from the Ethernet header on, in the order the
+    /// packets arrived, and hands the frames back to the kernel afterwards. Does not block.
+    /// Returns the number of frames.
+    pub fn recv(&mut self, mut on_frame: impl FnMut(&[u8])) -> usize {
+        let ready = self.rx_ready();
+        if ready == 0 {
+            return 0;
+        }
+        unsafe {
+            let rx_desc = self.rx.desc as *const libc::xdp_desc;
+            let fill_desc = self.fill.desc as *mut u64;
+            let rx_consumer = (*self.rx.consumer).load(Ordering::Relaxed);
+            // every frame not in the fill ring is in the RX ring or here, so there is room
+            let fill_producer = (*self.fill.producer).load(Ordering::Relaxed);
+
+            for i in 0..ready {
+                let desc = &*rx_desc.add((rx_consumer.wrapping_add(i) & (RING_SIZE - 1)) as usize);
+                on_frame(std::slice::from_raw_parts(self.umem.add(desc.addr as usize), desc.len as usize));
+                // the address points past the frame's headroom; hand back the whole frame
+                *fill_desc.add((fill_producer.wrapping_add(i) & (RING_SIZE - 1)) as usize) =
+                    desc.addr - desc.addr % FRAME_SIZE as u64;
+            }
+            (*self.rx.consumer).store(rx_consumer.wrapping_add(ready), Ordering::Release);
+            (*self.fill.producer).store(fill_producer.wrapping_add(ready), Ordering::Release);
+
+            // the driver stops polling the fill ring once it ran dry, until it is woken up
+            if (*self.fill.flags).load(Ordering::Relaxed) & libc::XDP_RING_NEED_WAKEUP != 0 {
+                libc::recvfrom(self.fd, std::ptr::null_mut(), 0, libc::MSG_DONTWAIT, std::ptr::null_mut(), std::ptr::null_mut());
+            }
+        }
+        ready as usize
+    }
+}
+
+impl Drop for XskSocket {
+    fn drop(&mut self) {
+        unsafe {
+            let _ = bpf::unregister_xsk(self.queue, self.port);
+            // unmap the rings before the socket goes away
+            self.rx = Ring::UNMAPPED;
+            self.fill = Ring::UNMAPPED;
+            libc::close(self.fd);
+            libc::munmap(self.umem as *mut c_void, RING_SIZE as usize * FRAME_SIZE);
+        }
+    }
+}
+
+/// The UDP payload of an Ethernet frame carrying IPv4 or IPv6 (without extension headers), or
+/// `None` for anything else. IPv4 fragments are `None` too, the first one included: there is no
+/// reassembly here, and a datagram missing its tail is no use to [`crate::rtp`].
+pub fn udp_payload(frame: &[u8]) -> Option<&[u8]> {
+    const ETH_HLEN: usize = 14;
+    const UDP_HLEN: usize = 8;
+    // the more fragments flag and fragment offset of the IPv4 header's frag_off
+    const IP_MF_OFFSET: u16 = 0x3fff;
+
+    let ethertype = u16::from_be_bytes(frame.get(12..14)?.try_into().unwrap());
+    let (proto, l4_off) = match ethertype {
+        0x0800 => {
+            let frag_off = u16::from_be_bytes(frame.get(ETH_HLEN + 6..ETH_HLEN + 8)?.try_into().unwrap());
+            if frag_off & IP_MF_OFFSET != 0 {
+                return None;
+            }
+            (*frame.get(ETH_HLEN + 9)?, ETH_HLEN + ((*frame.get(ETH_HLEN)? & 0xf) as usize) * 4)
+        }
+        0x86dd => (*frame.get(ETH_HLEN + 6)?, ETH_HLEN + 40),
+        _ => return None,
+    };
+    if proto != libc::IPPROTO_UDP as u8 {
+        return None;
+    }
+    let udp = frame.get(l4_off..l4_off + UDP_HLEN)?;
+    let udp_len = u16::from_be_bytes([udp[4], udp[5]]) as usize;
+    frame.get(l4_off + UDP_HLEN..l4_off + udp_len.max(UDP_HLEN))
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    const PAYLOAD: &[u8] = b"keymash";
+
+    /// An Ethernet frame of `ethertype` with `l3` (the IP header) and a UDP datagram of PAYLOAD.
+    fn frame(ethertype: u16, l3: &[u8]) -> Vec<u8> {
+        let mut frame = vec![0u8; 12];
+        frame.extend_from_slice(&ethertype.to_be_bytes());
+        frame.extend_from_slice(l3);
+        frame.extend_from_slice(&[0xab, 0xcd, 0xab, 0xe2]);
+        frame.extend_from_slice(&(8 + PAYLOAD.len() as u16).to_be_bytes());
+        frame.extend_from_slice(&[0, 0]);
+        frame.extend_from_slice(PAYLOAD);
+        frame
+    }
+
+    fn ipv4(frag_off: u16, proto: u8) -> [u8; 20] {
+        let mut iph = [0u8; 20];
+        iph[0] = 0x45;
+        iph[6..8].copy_from_slice(&frag_off.to_be_bytes());
+        iph[9] = proto;
+        iph
+    }
+
+    fn ipv6(nexthdr: u8) -> [u8; 40] {
+        let mut ip6h = [0u8; 40];
+        ip6h[0] = 0x60;
+        ip6h[6] = nexthdr;
+        ip6h
+    }
+
+    #[test]
+    fn test_udp_payload() {
+        let udp = libc::IPPROTO_UDP as u8;
+        assert_eq!(udp_payload(&frame(0x0800, &ipv4(0, udp))), Some(PAYLOAD));
+        // don't fragment is not a fragment
+        assert_eq!(udp_payload(&frame(0x0800, &ipv4(0x4000, udp))), Some(PAYLOAD));
+        assert_eq!(udp_payload(&frame(0x86dd, &ipv6(udp))), Some(PAYLOAD));
+
+        // an IPv4 header with options
+        let mut iph = [0u8; 24];
+        iph[..20].copy_from_slice(&ipv4(0, udp));
+        iph[0] = 0x46;
+        assert_eq!(udp_payload(&frame(0x0800, &iph)), Some(PAYLOAD));
+    }
+
+    #[test]
+    fn test_udp_payload_other() {
+        let tcp = libc::IPPROTO_TCP as u8;
+        assert_eq!(udp_payload(&frame(0x0800, &ipv4(0, tcp))), None);
+        assert_eq!(udp_payload(&frame(0x86dd, &ipv6(tcp))), None);
+        // an IPv6 extension header (hop-by-hop options) is not followed
+        assert_eq!(udp_payload(&frame(0x86dd, &ipv6(0))), None);
+        assert_eq!(udp_payload(&frame(0x0806, &ipv4(0, libc::IPPROTO_UDP as u8))), None);
+    }
+
+    #[test]
+    fn test_udp_payload_fragments() {
+        let udp = libc::IPPROTO_UDP as u8;
+        // a middle fragment and the last one
+        for frag_off in [0x2000 | 185, 370] {
+            assert_eq!(udp_payload(&frame(0x0800, &ipv4(frag_off, udp))), None, "frag_off {frag_off:#x}");
+        }
+    }
+
+    #[test]
+    fn test_udp_payload_first_fragment() {
+        // more fragments at offset 0 carries a complete UDP header, but only part of the
+        // datagram; the XDP program leaves these to the stack too
+        let first = frame(0x0800, &ipv4(0x2000, libc::IPPROTO_UDP as u8));
+        assert_eq!(&first[first.len() - PAYLOAD.len()..], PAYLOAD);
+        assert_eq!(udp_payload(&first), None);
+    }
+
+    #[test]
+    fn test_udp_payload_short() {
+        let full = frame(0x0800, &ipv4(0, libc::IPPROTO_UDP as u8));
+        for len in 0..14 + 20 + 8 {
+            assert_eq!(udp_payload(&full[..len]), None, "len {len}");
+        }
+        // a truncated payload is dropped rather than cut short
+        assert_eq!(udp_payload(&full[..full.len() - 1]), None);
+
+        let full = frame(0x86dd, &ipv6(libc::IPPROTO_UDP as u8));
+        for len in 0..14 + 40 + 8 {
+            assert_eq!(udp_payload(&full[..len]), None, "len {len}");
+        }
+    }
+}